@@ -4,131 +4,522 @@
 #include <SDL2/SDL_image.h>
 #include <math.h>
 #include <string.h>
+#include <setjmp.h>
+#include <png.h>
+#include <jpeglib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 //This program is created to convert images to a ben day pop art picture.
 //The program is created by Chun You Sim.
 
 /////////////////////////////////////////////////////////////////////////////////////////////////
-//Creating functions to assist calculations
+//Program options which can be changed from the command line
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Colour quantization modes
+#define QUANTIZER_EXACT 0	//Median cut over every pixel of the image
+#define QUANTIZER_HISTOGRAM 1	//Median cut over the weighted cells of a colour histogram
+
+//Ways of combining the edges with the Ben Day image
+#define BLEND_REPLACE 0	//The edges replace the pixels under them with black
+#define BLEND_MULTIPLY 1	//The pixels are multiplied with a soft shadow of the edges, and the edges are drawn in black over them
+
+//Instruction sets the per pixel kernels can use, from the narrowest up
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+
+typedef struct BenDayOptions
+{
+	int quantizer;	//The colour quantization mode, QUANTIZER_EXACT or QUANTIZER_HISTOGRAM. Without --quantizer it depends on --strip-rows.
+	int threads;	//The number of threads to work with. 0 uses one for every CPU core.
+	double palette_reuse;	//How much worse the previous image's colour palette may fit before a new one is made. Below 0 never reuses.
+	int palette_samples;	//The number of pixels the colour palette is made from. 0 uses every pixel.
+	int palette_report;	//Set to print how the sampled colour palette compares with the exact one
+	int kmeans_iterations;	//The most rounds of k-means used to improve the median cut colour palette. 0 does not use k-means.
+	int simd;	//The widest instruction set the per pixel kernels may use. The CPU may limit it further.
+	double edge_sigma[2];	//The standard deviations of the light and heavy blurs of the edge detection. 0 uses the 3x3 and 5x5 kernels.
+	int stroke_width;	//The width in pixels the edges are drawn with. 0 thickens them by one pixel all round.
+	char *template_file;	//The Ben Day Dots template image. NULL uses the built in dot screen.
+	double dot_pitch;	//The distance between the dots of the built in screen in pixels. 0 picks it from the size of the image.
+	double dot_angle;	//The angle of the rows of dots of the built in screen in degrees.
+	int template_tile;	//Set to repeat the template at its own size instead of scaling it to every image
+	int template_cache;	//The most memory in MB the templates scaled to the sizes of the images may take
+	int blend;	//How the edges are combined with the image, BLEND_REPLACE or BLEND_MULTIPLY
+	char *output;	//The directory or file name pattern the Ben Day images are saved to without opening a window. NULL shows them in a window.
+	int batch_depth;	//The most images of a headless batch decoded and not yet saved at once. 0 uses one more than the number of threads.
+	int strip_rows;	//The number of rows of a headless image read, worked on and written at once. 0 works on the whole image at once.
+} BenDayOptions;
+
 /////////////////////////////////////////////////////////////////////////////////////////////////
+//Thread pool to share work between the cores
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Work which is smaller than this number of pixels is not worth handing to another thread
+#define PARALLEL_MINIMUM 65536
+
+typedef void (*TaskFunction)(void *data);
+
+//A piece of work waiting in the queue of the thread pool
+typedef struct Task
+{
+	TaskFunction function;	//The function to run
+	void *data;	//The data given to the function
+	SDL_atomic_t *pending;	//The counter of unfinished tasks of the group this task belongs to
+	struct Task *next;	//The next task in the queue
+} Task;
+
+typedef struct ThreadPool
+{
+	SDL_Thread **threads;	//The worker threads
+	int thread_count;	//The number of worker threads. The thread that waits for a group of tasks also works on them.
+	SDL_mutex *lock;	//Protects the queue
+	SDL_cond *wake;	//Signalled when a task is queued or finished
+	Task *head;	//The first task in the queue
+	Task *tail;	//The last task in the queue
+	int stopping;	//Set when the pool is being destroyed
+} ThreadPool;
 
-//Create callback function for C's qsort function
-//Source from Anderson,E,F.,2015. Computing for Graphics: Fundamental Algorithms
-int comp(const void *x,const void *y)
+//Create a function to run a task and mark it as finished
+void RunTask(ThreadPool *pool, Task *task)
 {
-if(*(int*)x < *(int*)y) return -1;
-if(*(int*)x == *(int*)y) return 0;
-else return 1;
+	/*Parameters are...
+	ThreadPool *pool:	The thread pool the task was queued on.
+	Task *task:	The task to be run. It is freed afterwards.*/
+	
+	task->function(task->data);
+	
+	SDL_AtomicAdd(task->pending, -1);
+	free(task);
+	
+	//Wake up anyone waiting for the group to finish
+	SDL_LockMutex(pool->lock);
+	SDL_CondBroadcast(pool->wake);
+	SDL_UnlockMutex(pool->lock);
 }
-//Source Ends here
 
-//Create a function to convert pixels to grayscale
-Uint32 CovertGrayscale(pixel)
+//Create a function for the worker threads to take tasks from the queue until the pool is destroyed
+int ThreadPoolWorker(void *data)
 {
 	/*Parameters are...
-	pixel:	The pixel to be converted to grayscale*/
+	void *data:	The thread pool the worker belongs to.*/
+	
+	ThreadPool *pool = data;
+	
+	SDL_LockMutex(pool->lock);
+	while (1)
+	{
+		while (pool->head == NULL && !pool->stopping)
+		{
+			SDL_CondWait(pool->wake, pool->lock);
+		}
+		
+		if (pool->head == NULL)
+		{
+			break;
+		}
+		
+		Task *task = pool->head;
+		pool->head = task->next;
+		if (pool->head == NULL)
+		{
+			pool->tail = NULL;
+		}
+		
+		SDL_UnlockMutex(pool->lock);
+		RunTask(pool, task);
+		SDL_LockMutex(pool->lock);
+	}
+	SDL_UnlockMutex(pool->lock);
 	
-	Uint8 r = pixel >> 16 & 0xFF;
-	Uint8 g = pixel >> 8 & 0xFF;
-	Uint8 b = pixel & 0xFF;
-	Uint8 v = 0.212671f*r + 0.715160f*g + 0.072169f*b;
-	pixel = (0xFF<<24) | (v << 16) | (v<<8) | v;
-	return pixel;
+	return 0;
 }
 
-//Create function to sort colours into RGB and then qsort them
-void sortColourRGB(Uint32** array, Uint32 red[], Uint32 green[], Uint32 blue[], int totalsize, int startvalue)
+//Create a function to start the thread pool
+ThreadPool* CreateThreadPool(int thread_count)
 {
 	/*Parameters are...
-	Uint32** array:	The array with every pixel of the picture's RGB values in it.
-	Uint32 red[]:	The array to contain all the R values of array a.
-	Uint32 green[]:	The array to contain all the G values of array a.
-	Uint32 blue[]:	The array to contain all the B values of array a.
-	int totalsize:	The total number of pixels in the picture.
-	int startvalue:	The starting value in the array for the assigning to occur.*/
+	int thread_count:	The total number of threads to work with, including the main thread. 1 runs everything on the main thread.*/
+	
+	ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+	
+	if(pool == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	pool->lock = SDL_CreateMutex();
+	pool->wake = SDL_CreateCond();
+	pool->thread_count = thread_count-1;
+	if (pool->thread_count < 0)
+	{
+		pool->thread_count = 0;
+	}
+	
+	pool->threads = malloc((pool->thread_count+1)*sizeof(SDL_Thread*));
+	
+	if(pool->threads == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
 	
-	for (int i=startvalue, z=0; i<(totalsize); i++,z++)
+	for (int i=0; i<pool->thread_count; i++)
 	{
-		red[z] = array[i][0];
-		green[z] = array[i][1];
-		blue[z] = array[i][2];
+		pool->threads[i] = SDL_CreateThread(ThreadPoolWorker, "BenDayWorker", pool);
+		if (pool->threads[i] == NULL)
+		{
+			printf("Error in creating thread: %s\n",SDL_GetError());
+			pool->thread_count = i;
+			break;
+		}
 	}
-	//Quicksort the red, green and blue arrays
-	qsort(red,(totalsize-startvalue),sizeof(Uint32),&comp);	
-	qsort(green,(totalsize-startvalue),sizeof(Uint32),&comp);
-	qsort(blue,(totalsize-startvalue),sizeof(Uint32),&comp);
+	
+	return pool;
 }
 
-//Create a function for manual_qsort for a 2d array
-//Source code referenced from Anderson,E,F.,2015. Computing for Graphics: Fundamental Algorithms
-void manual_qsort(Uint32** a, int start, int end, int column)
+//Create a function to queue a task on the thread pool
+void SubmitTask(ThreadPool *pool, TaskFunction function, void *data, SDL_atomic_t *pending)
 {
 	/*Parameters are...
-	Uint32** a:	The array with every pixel of the picture's RGB values in it.
-	int start:	The starting value for the manual qsort.
-	int end:	The ending value for the manual qsort.
-	int column:	The column which indicates the longest axis to be sorted.*/
+	ThreadPool *pool:	The thread pool to queue the task on.
+	TaskFunction function:	The function to run.
+	void *data:	The data given to the function. It has to stay valid until the task is finished.
+	SDL_atomic_t *pending:	The counter of unfinished tasks of the group. It is increased here and decreased when the task is finished.*/
 	
-	int pivot, l, r;
-	int tmp1,tmp2,tmp3;
+	Task *task = malloc(sizeof(Task));
 	
-	if(start<end)
+	if(task == NULL)
 	{
-		pivot=a[start+(end-start)/2][column];
-		l=start;
-		r=end;
-		
-		while(l<r)
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	task->function = function;
+	task->data = data;
+	task->pending = pending;
+	task->next = NULL;
+	SDL_AtomicAdd(pending, 1);
+	
+	SDL_LockMutex(pool->lock);
+	if (pool->tail == NULL)
+	{
+		pool->head = task;
+	}
+	else
+	{
+		pool->tail->next = task;
+	}
+	pool->tail = task;
+	SDL_CondBroadcast(pool->wake);
+	SDL_UnlockMutex(pool->lock);
+}
+
+//Create a function to wait until a counter lowered by tasks is down to a number. The waiting thread runs queued tasks
+//in the meantime, so tasks can queue and wait for tasks of their own without running out of threads.
+void WaitForCount(ThreadPool *pool, SDL_atomic_t *counter, int most)
+{
+	/*Parameters are...
+	ThreadPool *pool:	The thread pool the tasks were queued on.
+	SDL_atomic_t *counter:	The counter to wait for. Only tasks of the pool may lower it, so the waiting thread is woken when they finish.
+	int most:	The highest value the counter may have when this returns.*/
+	
+	SDL_LockMutex(pool->lock);
+	while (SDL_AtomicGet(counter) > most)
+	{
+		if (pool->head != NULL)
 		{
-			while((a[l][column]<pivot) && (l<=end))
+			Task *task = pool->head;
+			pool->head = task->next;
+			if (pool->head == NULL)
 			{
-				l++;
+				pool->tail = NULL;
 			}
-			while((a[r][column]>pivot) && (r>=start))
-			{
-				r--;
-			}
-		
-			if (l<=r)
-			{
-				tmp1 = a[l][0];
-				tmp2 = a[l][1];
-				tmp3 = a[l][2];
-				
-				a[l][0] = a[r][0];
-				a[l][1] = a[r][1];
-				a[l][2] = a[r][2];
+			
+			SDL_UnlockMutex(pool->lock);
+			RunTask(pool, task);
+			SDL_LockMutex(pool->lock);
+		}
+		else
+		{
+			SDL_CondWait(pool->wake, pool->lock);
+		}
+	}
+	SDL_UnlockMutex(pool->lock);
+}
 
-				a[r][0] = tmp1;
-				a[r][1] = tmp2;
-				a[r][2] = tmp3;
-				
-				l++;
-				r--;
+//Create a function to wait for a group of tasks
+void WaitForTasks(ThreadPool *pool, SDL_atomic_t *pending)
+{
+	/*Parameters are...
+	ThreadPool *pool:	The thread pool the tasks were queued on.
+	SDL_atomic_t *pending:	The counter of unfinished tasks of the group.*/
+	
+	WaitForCount(pool, pending, 0);
+}
+
+//Number of bands made for every thread, so the threads which finish first can take the bands of a busier part of the image
+#define BANDS_PER_THREAD 4
+
+typedef void (*BandFunction)(void *data, int band, int start, int end);
+
+//A band of rows or a stripe of columns of an image that one task of ShareBands works on
+typedef struct BandTask
+{
+	BandFunction function;	//The function to run on the band
+	void *data;	//The data given to the function
+	int band;	//The number of the band
+	int start;	//The first row or column of the band
+	int end;	//The last row or column of the band +1
+} BandTask;
+
+void BandTaskRun(void *data)
+{
+	BandTask *task = data;
+	task->function(task->data, task->band, task->start, task->end);
+}
+
+//Create a function to work out how many bands the rows or columns of an image are split into
+int BandCount(ThreadPool *pool, int count, Sint64 size)
+{
+	/*Parameters are...
+	ThreadPool *pool:	The thread pool the bands will be shared out on.
+	int count:	The number of rows or columns.
+	Sint64 size:	The number of pixels in them.
+	Returns the number of bands, which is 1 when they are not worth sharing out. Every band has at least PARALLEL_MINIMUM pixels.*/
+	
+	Sint64 bands = (Sint64)(pool->thread_count+1)*BANDS_PER_THREAD;
+	if (pool->thread_count == 0) bands = 1;
+	if (bands > size/PARALLEL_MINIMUM) bands = size/PARALLEL_MINIMUM;
+	if (bands > count) bands = count;
+	return (bands<1) ? 1 : (int)bands;
+}
+
+//Create a function to split the rows or columns of an image into bands and share them out between the threads
+void ShareBands(ThreadPool *pool, int bands, int count, BandFunction function, void *data)
+{
+	/*Parameters are...
+	ThreadPool *pool:	The thread pool to share the bands with.
+	int bands:	The number of bands, from BandCount.
+	int count:	The number of rows or columns.
+	BandFunction function:	The function to run on every band, with the rows or columns from start to end-1.
+	void *data:	The data given to the function.
+	
+	A band may read rows outside itself but only writes its own, so the result does not depend on the number of bands.
+	A single band is run straight away on this thread.*/
+	
+	if (bands <= 1)
+	{
+		function(data, 0, 0, count);
+		return;
+	}
+	
+	BandTask *tasks = calloc(bands, sizeof(BandTask));
+	
+	if(tasks == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	SDL_atomic_t pending;
+	SDL_AtomicSet(&pending, 0);
+	for (int band=0; band<bands; band++)
+	{
+		tasks[band].function = function;
+		tasks[band].data = data;
+		tasks[band].band = band;
+		tasks[band].start = (int)((Sint64)count*band/bands);
+		tasks[band].end = (int)((Sint64)count*(band+1)/bands);
+		SubmitTask(pool, BandTaskRun, &tasks[band], &pending);
+	}
+	WaitForTasks(pool, &pending);
+	
+	free(tasks);
+}
+
+//Create a function to stop the worker threads and free the thread pool
+void DestroyThreadPool(ThreadPool *pool)
+{
+	/*Parameters are...
+	ThreadPool *pool:	The thread pool to be destroyed. Its queue has to be empty.*/
+	
+	SDL_LockMutex(pool->lock);
+	pool->stopping = 1;
+	SDL_CondBroadcast(pool->wake);
+	SDL_UnlockMutex(pool->lock);
+	
+	for (int i=0; i<pool->thread_count; i++)
+	{
+		SDL_WaitThread(pool->threads[i], NULL);
+	}
+	
+	SDL_DestroyCond(pool->wake);
+	SDL_DestroyMutex(pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Creating functions to assist calculations
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Colours handled by the quantization are packed into a single Uint32 as 0x00RRGGBB.
+//Column 0 is red, column 1 is green and column 2 is blue, the same order as the colour palette.
+#define PACK_RGB(r,g,b) (((Uint32)(r)<<16) | ((Uint32)(g)<<8) | (Uint32)(b))
+#define CHANNEL(colour,column) (((colour) >> (16-8*(column))) & 0xFF)
+
+//Grey value of a packed colour, 0.212671*R + 0.715160*G + 0.072169*B in 22 bit fixed point.
+//It gives the same value as the float sum cut down to a Uint8 for all but 38 of the 2^24 colours, where it is 1 away.
+#define LUMA(colour) ((892007u*CHANNEL(colour,0) + 2999598u*CHANNEL(colour,1) + 302699u*CHANNEL(colour,2)) >> 22)
+
+//Create a function to count the values of every channel in part of the colour array
+void CountChannels(Uint32* colour, Sint64 start, Sint64 end, Sint64 count[3][256])
+{
+	/*Parameters are...
+	Uint32* colour:	The array with every pixel of the picture's packed RGB value in it.
+	Sint64 start:	The first index to count.
+	Sint64 end:	The last index +1 to count.
+	Sint64 count[3][256]:	The counts of every R, G and B value. They are added to, so they have to start at 0.*/
+	
+	for (Sint64 i=start; i<end; i++)
+	{
+		count[0][CHANNEL(colour[i],0)]++;
+		count[1][CHANNEL(colour[i],1)]++;
+		count[2][CHANNEL(colour[i],2)]++;
+	}
+}
+
+//The part of a box that one task of CountBoxChannels counts
+typedef struct CountTask
+{
+	Uint32 *colour;
+	Sint64 start;
+	Sint64 end;
+	Sint64 count[3][256];
+} CountTask;
+
+void CountChannelsTask(void *data)
+{
+	CountTask *task = data;
+	CountChannels(task->colour, task->start, task->end, task->count);
+}
+
+//Create a function to count the channels of a box, sharing big boxes out between the threads
+void CountBoxChannels(Uint32* colour, Sint64 start, Sint64 end, Sint64 count[3][256], ThreadPool *pool)
+{
+	/*Parameters are...
+	Uint32* colour:	The array with every pixel of the picture's packed RGB value in it.
+	Sint64 start:	The first index of the box.
+	Sint64 end:	The last index +1 of the box.
+	Sint64 count[3][256]:	The counts of every R, G and B value in the box.
+	ThreadPool *pool:	The thread pool to share the counting with.*/
+	
+	memset(count, 0, 3*256*sizeof(Sint64));
+	
+	int parts = pool->thread_count+1;
+	if ((end-start) < PARALLEL_MINIMUM*2 || parts == 1)
+	{
+		CountChannels(colour, start, end, count);
+		return;
+	}
+	
+	//Every part is counted separately and then added up, so the result does not depend on the number of threads
+	CountTask *tasks = calloc(parts, sizeof(CountTask));
+	
+	if(tasks == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	SDL_atomic_t pending;
+	SDL_AtomicSet(&pending, 0);
+	for (int part=0; part<parts; part++)
+	{
+		tasks[part].colour = colour;
+		tasks[part].start = start+(end-start)*part/parts;
+		tasks[part].end = start+(end-start)*(part+1)/parts;
+		SubmitTask(pool, CountChannelsTask, &tasks[part], &pending);
+	}
+	WaitForTasks(pool, &pending);
+	
+	for (int part=0; part<parts; part++)
+	{
+		for (int column=0; column<3; column++)
+		{
+			for (int value=0; value<256; value++)
+			{
+				count[column][value] += tasks[part].count[column][value];
 			}
 		}
-		
-		manual_qsort(a,start,r,column);
-		manual_qsort(a,l,end,column);
 	}
+	
+	free(tasks);
 }
-//Source code reference ends here
 
-//Create a function to find out the longest axis for the median cut algorithm to cut
-int longest_axisRGB(Uint32 red[], Uint32 green[], Uint32 blue[], int totalsize, int startvalue)
+//Create a function to split a box of the colour array around its median on one channel
+void PartitionAtMedian(Uint32* colour, Sint64 start, Sint64 end, Sint64 middle, int column, const Sint64 count[256])
 {
 	/*Parameters are...
-	Uint32 red[]:	The array that contains all the R values of the picture.
-	Uint32 green[]:	The array that contains all the G values of the picture.
-	Uint32 blue[]:	The array that contains all the B values of the picture.
-	int totalsize:	The total number of pixels in the picture.
-	int startvalue:	The starting value for the assigning to occur.*/
+	Uint32* colour:	The array with every pixel of the picture's packed RGB value in it.
+	Sint64 start:	The first index of the box.
+	Sint64 end:	The last index +1 of the box.
+	Sint64 middle:	The index where the box will be cut. Afterwards no value before middle is bigger than a value from middle onwards.
+	int column:	The column which indicates the longest axis to be split on.
+	const Sint64 count[256]:	The count of every value of the column in the box. As they are 8 bit this finds the median without sorting.*/
 	
-	int longestR, longestG, longestB, longestColumn;
+	int median = 0;
+	Sint64 below = 0;	//Number of values smaller than the median
+	while (below+count[median] <= (middle-start))
+	{
+		below += count[median];
+		median++;
+	}
+	
+	//Three way partition: values smaller than the median go to the front, bigger ones to the back, equal ones stay in between.
+	//The middle index always falls in the equal part, so cutting there gives the same halves as a full sort would.
+	Sint64 l = start;
+	Sint64 i = start;
+	Sint64 r = end-1;
+	while (i<=r)
+	{
+		int value = CHANNEL(colour[i],column);
+		Uint32 tmp = colour[i];
+		
+		if (value<median)
+		{
+			colour[i] = colour[l];
+			colour[l] = tmp;
+			l++;
+			i++;
+		}
+		else if (value>median)
+		{
+			colour[i] = colour[r];
+			colour[r] = tmp;
+			r--;
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+//Create a function to pick the longest axis out of the range of each channel
+int longest_axisRange(int longestR, int longestG, int longestB)
+{
+	/*Parameters are...
+	int longestR:	The difference between the largest and smallest R value.
+	int longestG:	The difference between the largest and smallest G value.
+	int longestB:	The difference between the largest and smallest B value.*/
 	
-	longestR = red[totalsize-1] - red[startvalue];
-	longestB = blue[totalsize-1] - blue[startvalue];
-	longestG = green[totalsize-1] - green[startvalue];
+	int longestColumn;
 	
 	if (longestR>longestB)
 	{
@@ -163,727 +554,4676 @@ int longest_axisRGB(Uint32 red[], Uint32 green[], Uint32 blue[], int totalsize,
 }
 
 //Creating a function for the Median Cut Algorithm
-void MedianCutAlgorithm(Uint32** colour, Uint32 colour_palette[][3], int startvalue, int totalsize, int MaxElementCount, int *counterNum_ptr)
+void MedianCutAlgorithm(Uint32* colour, Uint32 colour_palette[][3], Sint64 startvalue, Sint64 totalsize, Sint64 MaxElementCount, int palette_start, int palette_count, ThreadPool *pool);
+
+//The arguments of a MedianCutAlgorithm call that runs as a task on the thread pool
+typedef struct MedianCutTask
+{
+	Uint32 *colour;
+	Uint32 (*colour_palette)[3];
+	Sint64 startvalue;
+	Sint64 totalsize;
+	Sint64 MaxElementCount;
+	int palette_start;
+	int palette_count;
+	ThreadPool *pool;
+} MedianCutTask;
+
+void MedianCutAlgorithmTask(void *data)
+{
+	MedianCutTask *task = data;
+	MedianCutAlgorithm(task->colour, task->colour_palette, task->startvalue, task->totalsize, task->MaxElementCount, task->palette_start, task->palette_count, task->pool);
+}
+
+void MedianCutAlgorithm(Uint32* colour, Uint32 colour_palette[][3], Sint64 startvalue, Sint64 totalsize, Sint64 MaxElementCount, int palette_start, int palette_count, ThreadPool *pool)
 {
 	/*Parameters are...
-	Uint32** colour:	The array with every pixel of the picture's RGB values in it.
+	Uint32* colour:	The array with every pixel of the picture's packed RGB value in it.
 	Uint32 colour_palette[][3]:	The 2D array which will store the reduced colour palette.
-	int startvalue:	The starting index for where the Median Cut Algorithm is to work on.
-	int totalsize:	The last index +1 for where the Median Cut Algorithm is to work on.
-	int MaxElementCount:	The minimum element count between start and end for the function to not continue to cut the array but get the colour_palette instead.
-	int *counterNum_ptr:	The pointer to an integer which helps to cycle through the assignment of the colour_palette array*/
+	Sint64 startvalue:	The starting index for where the Median Cut Algorithm is to work on.
+	Sint64 totalsize:	The last index +1 for where the Median Cut Algorithm is to work on.
+	Sint64 MaxElementCount:	The minimum element count between start and end for the function to not continue to cut the array but get the colour_palette instead.
+	int palette_start:	The first colour_palette index that belongs to this part of the cut.
+	int palette_count:	The number of colour_palette entries this part of the cut has to fill. The first half goes to the first cut and the rest to the second,
+					so every entry comes from the same place in the cut no matter which thread gets there first.
+	ThreadPool *pool:	The thread pool which the two halves of a big cut are shared out on.*/
 	
-	int start, end, longestColumn;
+	Sint64 start, end;
+	int longestColumn;
 	start = startvalue;
 	end = totalsize;
 	
-	int average_R, average_G, average_B;
+	//64 bit sums so a large box of bright pixels cannot overflow
+	Uint64 average_R, average_G, average_B;
 	average_R = average_G = average_B = 0;
-	if (((end)-start) <= MaxElementCount)	//If end-start is below or equals to the MaxElementCount, get the colour palette.
+	if (((end)-start) <= MaxElementCount || palette_count == 1)	//If end-start is below or equals to the MaxElementCount, get the colour palette.
 	{
-		for (int i = start; i<end; i++)
+		for (Sint64 i = start; i<end; i++)
 		{
-		average_R += colour[i][0];
-		average_G += colour[i][1];
-		average_B += colour[i][2];
+		average_R += CHANNEL(colour[i],0);
+		average_G += CHANNEL(colour[i],1);
+		average_B += CHANNEL(colour[i],2);
 		}
 		
 		average_R /= ((end)-start);
 		average_G /= ((end)-start);
 		average_B /= ((end)-start);
 		
-		*counterNum_ptr += 1;
-		printf("colour palette of index %d is generated\n",*counterNum_ptr);
-		colour_palette[*counterNum_ptr][0] = average_R;
-		colour_palette[*counterNum_ptr][1] = average_G;
-		colour_palette[*counterNum_ptr][2] = average_B;
+		//Only a small image can stop early, then the colour fills all of the entries of this part
+		for (int i = palette_start; i<(palette_start+palette_count); i++)
+		{
+		colour_palette[i][0] = average_R;
+		colour_palette[i][1] = average_G;
+		colour_palette[i][2] = average_B;
+		}
 	} 
 	
 	else
 	{
-	//Introduce RGB arrays to store the colours. All of the array sizes should be w*h
+	//Count every channel in the box with a single scan, which gives both the ranges and the median
+	Sint64 count[3][256];
+	int minimum[3], maximum[3];
 	
-	Uint32 *red, *green, *blue;
+	CountBoxChannels(colour, start, end, count, pool);
 	
-	red = malloc((totalsize)*sizeof(Uint32));
-	
-	if(red == NULL)
+	for (int column = 0; column<3; column++)
 	{
-		printf("Insufficient memory\n");
-		exit(1);
+		minimum[column] = 0;
+		while (count[column][minimum[column]] == 0) minimum[column]++;
+		maximum[column] = 255;
+		while (count[column][maximum[column]] == 0) maximum[column]--;
 	}
 	
-	green = malloc((totalsize)*sizeof(Uint32));
+	//Get the longest axis of the RGB
+	longestColumn = longest_axisRange(maximum[0]-minimum[0], maximum[1]-minimum[1], maximum[2]-minimum[2]);
 	
-	if(green == NULL)
-	{
-		printf("Insufficient memory\n");
-		exit(1);
-	}
+	//Split the colour array around the median of the longest channel. Nothing is allocated or sorted.
+	Sint64 middle = ((end-start)/2)+start;
+	PartitionAtMedian(colour, start, end, middle, longestColumn, count[longestColumn]);
 	
-	blue = malloc((totalsize)*sizeof(Uint32));
+	//Divide it into half and do a recursive function. The halves do not overlap, so a big second half is handed to another thread.
+	MedianCutTask second = {colour, colour_palette, middle, end, MaxElementCount, palette_start+(palette_count/2), palette_count-(palette_count/2), pool};
 	
-	if(blue == NULL)
+	if (pool->thread_count>0 && (end-middle) >= PARALLEL_MINIMUM)
 	{
-		printf("Insufficient memory\n");
-		exit(1);
+		SDL_atomic_t pending;
+		SDL_AtomicSet(&pending, 0);
+		SubmitTask(pool, MedianCutAlgorithmTask, &second, &pending);
+		MedianCutAlgorithm(colour, colour_palette, start, middle, MaxElementCount, palette_start, palette_count/2, pool);
+		WaitForTasks(pool, &pending);
 	}
 	
-	//sort pixel array into individual colours
-	//Do a quick sort of the RGB arrays
-	sortColourRGB(colour, red, green, blue, end, start);
+	else
+	{
+		MedianCutAlgorithm(colour, colour_palette, start, middle, MaxElementCount, palette_start, palette_count/2, pool);
+		MedianCutAlgorithmTask(&second);
+	}
+	}
+}
 
-	//Get the longest axis of the RGB
-	longestColumn = longest_axisRGB(red, green, blue, end, start);
-	
-	//Sort the colour array according to longest channel
-	manual_qsort(colour, start, (end-1), longestColumn);
+//Number of bits kept per channel by the colour histogram. 5 bits gives 32x32x32 cells.
+#define HISTOGRAM_BITS 5
+#define HISTOGRAM_SIZE (1<<(3*HISTOGRAM_BITS))
 
-	//Free RGB
-	free(red);
-	free(green);
-	free(blue);
-	
-	//Divide it into half and do a recursive function
-	MedianCutAlgorithm(colour, colour_palette, start, (((end-start)/2)+start), MaxElementCount, counterNum_ptr);
-	MedianCutAlgorithm(colour, colour_palette, (((end-start)/2)+start), end, MaxElementCount, counterNum_ptr);
-	}
+//A cell of the colour histogram. The sums keep the exact average colour of the pixels in the cell.
+typedef struct HistogramCell
+{
+	Uint64 count;	//Number of pixels which fall into the cell
+	Uint64 sum[3];	//Sum of the R, G and B values of those pixels
+	Uint32 colour;	//Packed average colour of the cell, used to sort and split the cells
+} HistogramCell;
+
+//Create callback functions for C's qsort function to sort histogram cells along one channel
+int compCellRed(const void *x,const void *y)
+{
+	return (int)CHANNEL(((const HistogramCell*)x)->colour,0) - (int)CHANNEL(((const HistogramCell*)y)->colour,0);
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////
-//Creating Working Functions
-/////////////////////////////////////////////////////////////////////////////////////////////////
-void ColourQuantization(SDL_Surface* QuantizedSurface, int w,int h, Uint32 * Quantized_Pixels, int colour_palette_no)
+int compCellGreen(const void *x,const void *y)
+{
+	return (int)CHANNEL(((const HistogramCell*)x)->colour,1) - (int)CHANNEL(((const HistogramCell*)y)->colour,1);
+}
+
+int compCellBlue(const void *x,const void *y)
+{
+	return (int)CHANNEL(((const HistogramCell*)x)->colour,2) - (int)CHANNEL(((const HistogramCell*)y)->colour,2);
+}
+
+//Create a function to add pixels to the cells of the colour histogram
+void BinColourHistogram(const Uint32* colour, Sint64 totalsize, HistogramCell *cells)
 {
 	/*Parameters are...
-	SDL_Surface* QuantizedSurface:	The SDL Surface which contains the image to be quantized.
-	int w:	The width of the image.
-	int h:	The height of the image.
-	Uint32 * Quantized_Pixels:	The pixels to be quantized.
-	int colour_palette_no:	The number of colours that will result after the colour quantization.*/
-	
-	Uint32 **colour; //Creates 2D array pointers
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Get the RGB values of the image into an array
-	/////////////////////////////////////////////////////////////////////////////////////////////////
+	const Uint32* colour:	The array with the packed RGB values of the pixels in it. Only the low 24 bits are used.
+	Sint64 totalsize:	The number of pixels.
+	HistogramCell *cells:	The array of HISTOGRAM_SIZE cells the pixels are added to.*/
 	
-	//Malloc 2D colour array
-	colour = (Uint32 **) malloc(w*h*sizeof(Uint32*));
-	for (int i = 0; i < (w*h); i++ )
-	{
-		colour[i] = (Uint32*) malloc(3*sizeof(Uint32));
-	}
+	int shift = 8-HISTOGRAM_BITS;
 	
-	if(colour == NULL)
+	for (Sint64 i=0; i<totalsize; i++)
 	{
-		free(colour);
-		printf("Insufficient memory\n");
-		exit(1);
+		Uint32 r1 = CHANNEL(colour[i],0);
+		Uint32 g1 = CHANNEL(colour[i],1);
+		Uint32 b1 = CHANNEL(colour[i],2);
+		int index = ((r1>>shift)<<(2*HISTOGRAM_BITS)) | ((g1>>shift)<<HISTOGRAM_BITS) | (b1>>shift);
+		
+		cells[index].count++;
+		cells[index].sum[0] += r1;
+		cells[index].sum[1] += g1;
+		cells[index].sum[2] += b1;
 	}
+}
+
+//Create a function to move the non empty cells of the colour histogram to the front and return how many there are
+int CompactColourHistogram(HistogramCell *cells)
+{
+	/*Parameters are...
+	HistogramCell *cells:	The array of HISTOGRAM_SIZE cells, from BinColourHistogram.
+	Returns the number of non empty cells.*/
 	
-	for (int i = 0; i < (w*h); i++ )
+	//Move the non empty cells to the front of the array and work out their average colour
+	int cellcount = 0;
+	for (int i=0; i<HISTOGRAM_SIZE; i++)
 	{
-		if (colour[i] == NULL)
+		if (cells[i].count == 0)
 		{
-			free(colour[i]);
-			printf("Insufficient memory\n");
-			exit(1);
+			continue;
 		}
+		
+		cells[cellcount] = cells[i];
+		cells[cellcount].colour = PACK_RGB(cells[i].sum[0]/cells[i].count, cells[i].sum[1]/cells[i].count, cells[i].sum[2]/cells[i].count);
+		cellcount++;
 	}
 	
-	//Assigning the colour 2D array with the RGB coordinates of the picture
+	return cellcount;
+}
+
+//Create a function to bin every pixel into the colour histogram and return the cells that are not empty
+int BuildColourHistogram(const Uint32* colour, Sint64 totalsize, HistogramCell *cells)
+{
+	/*Parameters are...
+	const Uint32* colour:	The array with every pixel of the picture's packed RGB value in it. Only the low 24 bits are used.
+	Sint64 totalsize:	The total number of pixels in the picture.
+	HistogramCell *cells:	The array of HISTOGRAM_SIZE cells which will hold the non empty cells at the front.
+	Returns the number of non empty cells.*/
 	
-	int counting = 0;	// Variable to go through the colour array
+	memset(cells, 0, HISTOGRAM_SIZE*sizeof(HistogramCell));
+	BinColourHistogram(colour, totalsize, cells);
+	return CompactColourHistogram(cells);
+}
+
+//Creating a function for the Median Cut Algorithm over the weighted histogram cells
+void HistogramMedianCut(HistogramCell *cells, Uint32 colour_palette[][3], int start, int end, int palette_start, int palette_count)
+{
+	/*Parameters are...
+	HistogramCell *cells:	The non empty histogram cells.
+	Uint32 colour_palette[][3]:	The 2D array which will store the reduced colour palette.
+	int start:	The first cell of the box.
+	int end:	The last cell +1 of the box.
+	int palette_start:	The first colour_palette index that belongs to this box.
+	int palette_count:	The number of colour_palette entries this box has to fill.*/
 	
-	for (int y=0; y<h; y++)
+	//Cut until each box only has to fill one colour_palette entry. A box with a single cell cannot be cut so it fills all of its entries.
+	if (palette_count == 1 || (end-start) == 1)
 	{
-		for(int x=0; x<w; x++)
-		{
-		Uint8 r1,g1,b1;
+		Uint64 count = 0;
+		Uint64 average_R, average_G, average_B;
+		average_R = average_G = average_B = 0;
 		
-		SDL_GetRGB(Quantized_Pixels[y*w + x], QuantizedSurface->format, &r1,&g1,&b1);
-		colour[counting][0] = r1;
-		colour[counting][1] = g1;
-		colour[counting][2] = b1;
-		counting++;
-		}
+		for (int i = start; i<end; i++)
+		{
+		count += cells[i].count;
+		average_R += cells[i].sum[0];
+		average_G += cells[i].sum[1];
+		average_B += cells[i].sum[2];
+		}
+		
+		average_R /= count;
+		average_G /= count;
+		average_B /= count;
+		
+		for (int i = palette_start; i<(palette_start+palette_count); i++)
+		{
+		colour_palette[i][0] = average_R;
+		colour_palette[i][1] = average_G;
+		colour_palette[i][2] = average_B;
+		}
+		return;
 	}
 	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//Find the range of each channel in the box with a single scan
+	int minimum[3] = {255,255,255};
+	int maximum[3] = {0,0,0};
+	Uint64 boxcount = 0;
 	
-	//Introducing variables. The totalsize should depends on how many pixels that exist in the image.
-	int totalsize = w*h;
-	int longestColumn;
-	//Create a counter to pass the average RGB values into the colour_palette array
-	int counterNum = -1;
-	int *counterNum_ptr = &counterNum;
-	//Colour_palette_no refers to the maximum number of colours in the colour palette that should result.
-	//colour_palette_no. It should be a power of 2
+	for (int i = start; i<end; i++)
+	{
+		for (int column = 0; column<3; column++)
+		{
+			int value = CHANNEL(cells[i].colour,column);
+			if (value<minimum[column]) minimum[column] = value;
+			if (value>maximum[column]) maximum[column] = value;
+		}
+		boxcount += cells[i].count;
+	}
 	
-	//Counting how many elements should be in the final cut for the median cut algorithm to stop
-	int MaxElementCount = totalsize/colour_palette_no;
-	if (totalsize%colour_palette_no>0)
+	int longestColumn = longest_axisRange(maximum[0]-minimum[0], maximum[1]-minimum[1], maximum[2]-minimum[2]);
+	
+	//Sort the cells of the box according to the longest channel
+	int (*compare[3])(const void*, const void*) = {&compCellRed, &compCellGreen, &compCellBlue};
+	qsort(cells+start, end-start, sizeof(HistogramCell), compare[longestColumn]);
+	
+	//Cut after the cell where the running pixel count reaches half of the box. Both halves keep at least one cell.
+	int middle = start;
+	Uint64 running = 0;
+	while (middle<(end-1) && (running+cells[middle].count)*2 <= boxcount)
 	{
-		MaxElementCount = MaxElementCount+1;
+		running += cells[middle].count;
+		middle++;
+	}
+	if (middle == start)
+	{
+		middle++;
 	}
 	
-	//Create the array for the reduced colour palette
-	Uint32 colour_palette[colour_palette_no][3];
+	HistogramMedianCut(cells, colour_palette, start, middle, palette_start, palette_count/2);
+	HistogramMedianCut(cells, colour_palette, middle, end, palette_start+(palette_count/2), palette_count-(palette_count/2));
+}
+
+//Create a function to improve a colour palette with a few rounds of k-means over the histogram cells
+int KMeansRefine(HistogramCell *cells, int cellcount, Uint32 colour_palette[][3], int colour_palette_no, int iterations, double *skipped)
+{
+	/*Parameters are...
+	HistogramCell *cells:	The non empty histogram cells. Each one stands for its pixels at their average colour.
+	int cellcount:	The number of non empty cells.
+	Uint32 colour_palette[][3]:	The colour palette to start from. It is replaced with the improved colour palette.
+	int colour_palette_no:	The number of colours in the colour palette. It can be at most 256.
+	int iterations:	The most rounds of k-means to do.
+	double *skipped:	Set to the share of the distances between cells and colour palette entries that did not have to be worked out.
+	Returns the number of rounds done. It stops early once no cell changes its entry.
 	
-	//Getting the reduced colour_palette using Median Cut Function
-	MedianCutAlgorithm(colour, colour_palette, 0, totalsize, MaxElementCount, counterNum_ptr);
+	A cell only has to be compared with an entry when the entry is less than twice as far from the closest entry found so far
+	as the cell is, by the triangle inequality. Most cells are closer to their entry than half the distance to any other
+	entry, and they skip the search completely.*/
 	
-	//Assigning reduced colour_palette to image
-	counting = 0;
+	int *assigned = malloc(cellcount*sizeof(int));
 	
-	for (int y=0; y<h; y++)
+	if(assigned == NULL)
 	{
-		for(int x=0; x<w; x++)
-		{
-		Uint8 r1,g1,b1;
-		SDL_GetRGB(Quantized_Pixels[y*w + x], QuantizedSurface->format, &r1,&g1,&b1);
-		
-		int compare1, compare2, Euclidean_Distance, closest_colour_R, closest_colour_G, closest_colour_B;
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	int centre[256][3];
+	int between[256][256];	//Squared distances between the entries
+	int nearest_other[256];	//Squared distance from each entry to the closest other entry
+	Uint64 total[256][4];	//Pixel count and R, G, B sums of the cells given to each entry
+	Uint64 computed = 0, possible = 0;
+	
+	for (int z=0; z<colour_palette_no; z++)
+	{
+		centre[z][0] = colour_palette[z][0];
+		centre[z][1] = colour_palette[z][1];
+		centre[z][2] = colour_palette[z][2];
+	}
+	for (int i=0; i<cellcount; i++)
+	{
+		assigned[i] = 0;
+	}
+	
+	int round = 0;
+	int changed = 1;
+	while (round<iterations && changed)
+	{
+		round++;
+		changed = 0;
 		
-			for(int z=0; z<(colour_palette_no); z++)	//Finding the closest colour_palette to the pixel
+		for (int z=0; z<colour_palette_no; z++)
+		{
+			nearest_other[z] = 3*255*255+1;
+			for (int j=0; j<colour_palette_no; j++)
 			{
-			int a,b,c;
+				int a = centre[z][0]-centre[j][0];
+				int b = centre[z][1]-centre[j][1];
+				int c = centre[z][2]-centre[j][2];
+				between[z][j] = a*a+b*b+c*c;
+				if (j != z && between[z][j]<nearest_other[z])
+				{
+					nearest_other[z] = between[z][j];
+				}
+			}
+		}
+		memset(total, 0, colour_palette_no*sizeof(total[0]));
+		
+		//Give every cell to its closest entry, starting from the entry it had
+		for (int i=0; i<cellcount; i++)
+		{
+			int r1 = CHANNEL(cells[i].colour,0);
+			int g1 = CHANNEL(cells[i].colour,1);
+			int b1 = CHANNEL(cells[i].colour,2);
+			int closest = assigned[i];
+			int a = centre[closest][0]-r1;
+			int b = centre[closest][1]-g1;
+			int c = centre[closest][2]-b1;
+			int closest_distance = a*a+b*b+c*c;
+			computed++;
+			possible += colour_palette_no;
 			
-			a = (colour_palette[z][0] - r1)*(colour_palette[z][0] - r1);
-			b = (colour_palette[z][1] - g1)*(colour_palette[z][1] - g1);
-			c = (colour_palette[z][2] - b1)*(colour_palette[z][2] - b1);
+			//Another entry can only be closer when |x-c| > |c-c'|/2, so compare squared distances as 4|x-c|^2 > |c-c'|^2.
+			//The test is made against the closest entry found so far, as both sides of it have to come from the same entry.
+			if (4*closest_distance > nearest_other[closest])
+			{
+				int current = closest;
+				for (int z=0; z<colour_palette_no; z++)
+				{
+					if (z == current || between[closest][z] >= 4*closest_distance)
+					{
+						continue;
+					}
+					
+					a = centre[z][0]-r1;
+					b = centre[z][1]-g1;
+					c = centre[z][2]-b1;
+					int distance = a*a+b*b+c*c;
+					computed++;
+					if (distance<closest_distance)
+					{
+						closest_distance = distance;
+						closest = z;
+					}
+				}
+			}
 			
-			Euclidean_Distance = sqrt((a+b+c));
+			//The first round always counts as a change, since the entries have not been moved to their averages yet
+			if (closest != assigned[i] || round == 1)
+			{
+				assigned[i] = closest;
+				changed = 1;
+			}
+			total[closest][0] += cells[i].count;
+			total[closest][1] += cells[i].sum[0];
+			total[closest][2] += cells[i].sum[1];
+			total[closest][3] += cells[i].sum[2];
+		}
+		
+		//Move every entry to the average colour of its pixels. An entry that lost all of its cells stays where it is.
+		for (int z=0; z<colour_palette_no; z++)
+		{
+			if (total[z][0] > 0)
+			{
+				centre[z][0] = total[z][1]/total[z][0];
+				centre[z][1] = total[z][2]/total[z][0];
+				centre[z][2] = total[z][3]/total[z][0];
+			}
+		}
+	}
+	
+	for (int z=0; z<colour_palette_no; z++)
+	{
+		colour_palette[z][0] = centre[z][0];
+		colour_palette[z][1] = centre[z][1];
+		colour_palette[z][2] = centre[z][2];
+	}
+	
+	*skipped = (possible>0) ? 1.0-(double)computed/possible : 0;
+	free(assigned);
+	return round;
+}
+
+//Number of bits kept per channel by the inverse colour map. 5 bits gives 32x32x32 cells of 8x8x8 colours.
+#define COLOURMAP_BITS 5
+#define COLOURMAP_SIZE (1<<(3*COLOURMAP_BITS))
+#define COLOURMAP_LIST 256	//Cell values from this number up point into the candidate list instead of being a palette index
 
-			if (z == 0)	//If it is the first loop
+//Lookup table from a colour to its nearest colour_palette entry. Holds up to 256 palette entries.
+typedef struct InverseColourMap
+{
+	Uint32 cell[COLOURMAP_SIZE];	//The palette index for the cell, or COLOURMAP_LIST + position of the cell's candidates
+	Uint16 *candidates;	//For every listed cell, the number of candidates followed by their palette indexes
+} InverseColourMap;
+
+//Create a function to build the inverse colour map for a colour palette
+InverseColourMap* BuildInverseColourMap(Uint32 colour_palette[][3], int colour_palette_no)
+{
+	/*Parameters are...
+	Uint32 colour_palette[][3]:	The reduced colour palette.
+	int colour_palette_no:	The number of colours in the colour palette. It can be at most 256.
+	
+	Every cell keeps the palette entries which could be the closest to some colour inside the cell.
+	An entry can be left out when even its nearest point in the cell is further than the furthest point of another entry,
+	so the lookup always gives the exact closest entry. Most cells are left with only one entry.*/
+	
+	InverseColourMap *map = malloc(sizeof(InverseColourMap));
+	int listsize = 4096;
+	int listused = 0;
+	
+	if(map == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	map->candidates = malloc(listsize*sizeof(Uint16));
+	
+	if(map->candidates == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	int cellwidth = 1<<(8-COLOURMAP_BITS);
+	int mindistance[256];
+	
+	for (int i=0; i<COLOURMAP_SIZE; i++)
+	{
+		int low[3], high[3];
+		low[0] = (i>>(2*COLOURMAP_BITS))*cellwidth;
+		low[1] = ((i>>COLOURMAP_BITS)&((1<<COLOURMAP_BITS)-1))*cellwidth;
+		low[2] = (i&((1<<COLOURMAP_BITS)-1))*cellwidth;
+		
+		//Find the smallest distance any entry has to the furthest corner of the cell
+		int closest_maxdistance = 3*255*255+1;
+		for (int z=0; z<colour_palette_no; z++)
+		{
+			int mindist = 0;
+			int maxdist = 0;
+			for (int column=0; column<3; column++)
 			{
-				compare1 = Euclidean_Distance;
-				closest_colour_R = colour_palette[z][0];
-				closest_colour_G = colour_palette[z][1];
-				closest_colour_B = colour_palette[z][2];
+				high[column] = low[column]+cellwidth-1;
+				int value = colour_palette[z][column];
+				int near = 0;
+				if (value<low[column]) near = low[column]-value;
+				if (value>high[column]) near = value-high[column];
+				int far = (value-low[column] > high[column]-value) ? value-low[column] : high[column]-value;
+				mindist += near*near;
+				maxdist += far*far;
 			}
-			
-			else
+			mindistance[z] = mindist;
+			if (maxdist<closest_maxdistance)
 			{
-				compare2 = Euclidean_Distance;
+				closest_maxdistance = maxdist;
+			}
+		}
+		
+		//Keep every entry that can get as close as that
+		int candidatecount = 0;
+		int lastcandidate = 0;
+		for (int z=0; z<colour_palette_no; z++)
+		{
+			if (mindistance[z] <= closest_maxdistance)
+			{
+				candidatecount++;
+				lastcandidate = z;
+			}
+		}
+		
+		if (candidatecount == 1)
+		{
+			map->cell[i] = lastcandidate;
+			continue;
+		}
+		
+		if (listused+candidatecount+1 > listsize)
+		{
+			listsize = 2*listsize+candidatecount+1;
+			map->candidates = realloc(map->candidates, listsize*sizeof(Uint16));
 			
-				if (compare2<compare1)
-				{
-				compare1 = compare2;
-				closest_colour_R = colour_palette[z][0];
-				closest_colour_G = colour_palette[z][1];
-				closest_colour_B = colour_palette[z][2];
-				}
+			if(map->candidates == NULL)
+			{
+				printf("Insufficient memory\n");
+				exit(1);
 			}
+		}
+		
+		map->cell[i] = COLOURMAP_LIST+listused;
+		map->candidates[listused] = candidatecount;
+		listused++;
+		for (int z=0; z<colour_palette_no; z++)
+		{
+			if (mindistance[z] <= closest_maxdistance)
+			{
+				map->candidates[listused] = z;
+				listused++;
 			}
-		//Set colour of the pixel to the closest colour_palette
-		Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,closest_colour_R,closest_colour_G,closest_colour_B);
-		Quantized_Pixels[y*w+x] = pixel;
 		}
 	}
 	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	for (int i=0; i<h*w; i++)
+	return map;
+}
+
+//Create a function to free the inverse colour map
+void FreeInverseColourMap(InverseColourMap *map)
+{
+	/*Parameters are...
+	InverseColourMap *map:	The inverse colour map to be freed.*/
+	
+	free(map->candidates);
+	free(map);
+}
+
+//Create a function to find the closest colour_palette entry to a colour
+int NearestPaletteIndex(const InverseColourMap *map, Uint32 colour_palette[][3], Uint32 colour)
+{
+	/*Parameters are...
+	const InverseColourMap *map:	The inverse colour map of the colour palette.
+	Uint32 colour_palette[][3]:	The reduced colour palette.
+	Uint32 colour:	The packed RGB colour to be looked up.
+	Returns the index of the closest entry. When two entries are as close, the smaller index is returned.*/
+	
+	int r1 = CHANNEL(colour,0);
+	int g1 = CHANNEL(colour,1);
+	int b1 = CHANNEL(colour,2);
+	int shift = 8-COLOURMAP_BITS;
+	Uint32 cell = map->cell[((r1>>shift)<<(2*COLOURMAP_BITS)) | ((g1>>shift)<<COLOURMAP_BITS) | (b1>>shift)];
+	
+	if (cell < COLOURMAP_LIST)
+	{
+		return cell;
+	}
+	
+	//The cell is shared by a few entries, so compare the squared distances of those only
+	const Uint16 *list = map->candidates+(cell-COLOURMAP_LIST);
+	int closest = list[1];
+	int closest_distance = 3*255*255+1;
+	for (int i=1; i<=list[0]; i++)
+	{
+		int z = list[i];
+		int a = (int)colour_palette[z][0]-r1;
+		int b = (int)colour_palette[z][1]-g1;
+		int c = (int)colour_palette[z][2]-b1;
+		int distance = a*a+b*b+c*c;
+		if (distance<closest_distance)
 		{
-		free(colour[i]);
-		colour[i]=NULL;
+			closest_distance = distance;
+			closest = z;
 		}
-	free(colour);
-	colour = NULL;
-	counterNum_ptr = NULL;
+	}
+	
+	return closest;
+}
+
+//Number of pixels looked at to estimate how well a colour palette fits an image
+#define PALETTE_ERROR_SAMPLES 4096
+
+//A colour palette kept from an earlier image so that similar images can skip the median cut
+typedef struct PaletteCache
+{
+	int valid;	//Set once a colour palette has been stored
+	int colour_palette_no;	//The number of colours in the stored colour palette
+	Uint32 colour_palette[256][3];	//The stored colour palette
+	double error;	//The sampled error of the colour palette on the image it was made from
+} PaletteCache;
+
+//Create a function to pick the pixels in some rows of the image out of pixels spread evenly over it, one from every cell of a grid laid over it
+int StratifiedSampleRows(const Uint32 *pixels, int w, int h, int top, int bottom, int samples, Uint32 *colour)
+{
+	/*Parameters are...
+	const Uint32 *pixels:	The pixels of the rows, starting at row top.
+	int w:	The width of the image.
+	int h:	The height of the image.
+	int top:	The first row of the image in pixels.
+	int bottom:	The last row of the image in pixels +1.
+	int samples:	The most pixels to pick from the whole image.
+	Uint32 *colour:	The array which will store the packed RGB value of every picked pixel, with room for samples pixels.
+			A pixel goes to the same place whatever rows it is picked with, so picking from every strip of an image fills it
+			the same as picking from the whole image at once.
+	Returns the number of pixels picked from the whole image, which is never more than samples.*/
+	
+	//The grid has about the same shape as the image, so the cells are close to square
+	int columns = (int)sqrt((double)samples*w/h);
+	if (columns<1) columns = 1;
+	if (columns>w) columns = w;
+	//A very wide image would otherwise get more columns than samples, and one row of them would overrun the colour array
+	if (columns>samples) columns = samples;
+	int rows = samples/columns;
+	if (rows<1) rows = 1;
+	if (rows>h) rows = h;
+	
+	int counting = 0;
+	for (int row=0; row<rows; row++)
+	{
+		int celltop = (int)((Sint64)row*h/rows);
+		int cellheight = (int)((Sint64)(row+1)*h/rows)-celltop;
+		//A row of cells outside the rows given has none of its pixels picked, but keeps its places in the colour array
+		if (celltop+cellheight <= top || celltop >= bottom)
+		{
+			counting += columns;
+			continue;
+		}
+		
+		for (int column=0; column<columns; column++)
+		{
+			int left = (int)((Sint64)column*w/columns);
+			int cellwidth = (int)((Sint64)(column+1)*w/columns)-left;
+			
+			//Pick a place inside the cell from a hash of the cell, so the pick does not line up with patterns in the image
+			//but stays the same every time the program runs
+			Uint32 hash = (Uint32)row*0x9E3779B1u ^ (Uint32)column*0x85EBCA77u;
+			hash ^= hash>>15;
+			hash *= 0x2C1B3C6Du;
+			hash ^= hash>>13;
+			int x = left+(int)((hash&0xFFFF)%cellwidth);
+			int y = celltop+(int)((hash>>16)%cellheight);
+			
+			if (y >= top && y < bottom)
+			{
+				colour[counting] = pixels[(Sint64)(y-top)*w + x] & 0xFFFFFF;
+			}
+			counting++;
+		}
+	}
+	
+	return counting;
 }
 
-void EdgeDetection(int h, int w, SDL_Surface* BluredSurface, Uint32 *pixels, SDL_Surface* GreaterBluredSurface, Uint32 *GBS_Pixels)
+//Create a function to pick pixels spread evenly over the image, one from every cell of a grid laid over it
+int StratifiedSample(Uint32 *pixels, int w, int h, int samples, Uint32 *colour)
 {
 	/*Parameters are...
+	Uint32 *pixels:	The pixels of the image.
+	int w:	The width of the image.
+	int h:	The height of the image.
+	int samples:	The most pixels to pick.
+	Uint32 *colour:	The array which will store the packed RGB value of every picked pixel, with room for samples pixels.
+	Returns the number of pixels picked, which is never more than samples.*/
+	
+	return StratifiedSampleRows(pixels, w, h, 0, h, samples, colour);
+}
+
+//Create a function to work out how well a colour palette fits a set of colours
+double PaletteError(Uint32 *colour, Sint64 count, Uint32 colour_palette[][3], const InverseColourMap *colourmap)
+{
+	/*Parameters are...
+	Uint32 *colour:	The colours. Only the low 24 bits, the packed RGB value, are used.
+	Sint64 count:	The number of colours.
+	Uint32 colour_palette[][3]:	The colour palette.
+	const InverseColourMap *colourmap:	The inverse colour map of the colour palette.
+	Returns the root mean square distance between the colours and their closest colour_palette entry.*/
+	
+	double total = 0;
+	for (Sint64 i=0; i<count; i++)
+	{
+		Uint32 pixel = colour[i] & 0xFFFFFF;
+		int closest = NearestPaletteIndex(colourmap, colour_palette, pixel);
+		
+		int a = (int)colour_palette[closest][0]-(int)CHANNEL(pixel,0);
+		int b = (int)colour_palette[closest][1]-(int)CHANNEL(pixel,1);
+		int c = (int)colour_palette[closest][2]-(int)CHANNEL(pixel,2);
+		total += a*a+b*b+c*c;
+	}
+	
+	return sqrt(total/count);
+}
+
+//Create a function to estimate how well a colour palette fits an image from a sample of its pixels
+double SampledPaletteError(Uint32 *pixels, int w, int h, Uint32 colour_palette[][3], const InverseColourMap *colourmap)
+{
+	/*Parameters are...
+	Uint32 *pixels:	The pixels of the image.
+	int w:	The width of the image.
 	int h:	The height of the image.
+	Uint32 colour_palette[][3]:	The colour palette.
+	const InverseColourMap *colourmap:	The inverse colour map of the colour palette.
+	Returns the root mean square distance between the sampled pixels and their closest colour_palette entry.*/
+	
+	//StratifiedSample never picks more pixels than it is asked for, however narrow or wide the image is,
+	//so the samples fit in a fixed array on the stack
+	Uint32 colour[PALETTE_ERROR_SAMPLES];
+	int count = StratifiedSample(pixels, w, h, PALETTE_ERROR_SAMPLES, colour);
+	
+	return PaletteError(colour, count, colour_palette, colourmap);
+}
+
+//Create a function to make the reduced colour palette of an image from its colours or their colour histogram
+void CutColourPalette(Uint32 *colour, Sint64 totalsize, HistogramCell *cells, int cellcount, Uint32 colour_palette[][3], int colour_palette_no,
+	const BenDayOptions *options, ThreadPool *pool)
+{
+	/*Parameters are...
+	Uint32 *colour:	The packed RGB values the colour palette is made from. The exact median cut moves them around. NULL if only the histogram is given.
+	Sint64 totalsize:	The number of colours.
+	HistogramCell *cells:	The colour histogram of the colours with the non empty cells at the front, or NULL to bin it from the colours when it is needed.
+	int cellcount:	The number of non empty cells of the colour histogram.
+	Uint32 colour_palette[][3]:	The 2D array which will store the reduced colour palette.
+	int colour_palette_no:	The number of colours in the colour palette.
+	const BenDayOptions *options:	The program options, which choose the quantization mode.
+	ThreadPool *pool:	The thread pool to share the work with.*/
+	
+	//Colour_palette_no refers to the maximum number of colours in the colour palette that should result.
+	//colour_palette_no. It should be a power of 2
+	
+	//Counting how many elements should be in the final cut for the median cut algorithm to stop
+	Sint64 MaxElementCount = totalsize/colour_palette_no;
+	if (totalsize%colour_palette_no>0)
+	{
+		MaxElementCount = MaxElementCount+1;
+	}
+	
+	//The histogram is needed by the histogram median cut and by k-means
+	HistogramCell *binned = NULL;	//The histogram binned here, if it was not given
+	Uint64 start_time = SDL_GetPerformanceCounter();
+	
+	if (cells == NULL && (options->quantizer == QUANTIZER_HISTOGRAM || options->kmeans_iterations > 0))
+	{
+		binned = malloc(HISTOGRAM_SIZE*sizeof(HistogramCell));
+		
+		if(binned == NULL)
+		{
+			printf("Insufficient memory\n");
+			exit(1);
+		}
+		
+		cellcount = BuildColourHistogram(colour, totalsize, binned);
+		cells = binned;
+	}
+	
+	if (options->quantizer == QUANTIZER_HISTOGRAM)
+	{
+		//Getting the reduced colour_palette by median cutting the colour histogram, so the cost depends on the number of colours and not the image size
+		HistogramMedianCut(cells, colour_palette, 0, cellcount, 0, colour_palette_no);
+	}
+	
+	else
+	{
+		//Getting the reduced colour_palette using Median Cut Function
+		MedianCutAlgorithm(colour, colour_palette, 0, totalsize, MaxElementCount, 0, colour_palette_no, pool);
+	}
+	
+	if (options->kmeans_iterations > 0)
+	{
+		//Improving the median cut colour_palette with k-means over the histogram cells, so each round costs the same for any image size
+		double median_cut_time = (double)(SDL_GetPerformanceCounter()-start_time)/SDL_GetPerformanceFrequency();
+		start_time = SDL_GetPerformanceCounter();
+		double skipped;
+		int rounds = KMeansRefine(cells, cellcount, colour_palette, colour_palette_no, options->kmeans_iterations, &skipped);
+		double kmeans_time = (double)(SDL_GetPerformanceCounter()-start_time)/SDL_GetPerformanceFrequency();
+		
+		printf("%d colour palette: median cut took %.3f s, k-means took %.3f s for %d rounds over %d cells (%.0f%% of distances skipped)\n",
+			colour_palette_no, median_cut_time, kmeans_time, rounds, cellcount, 100*skipped);
+	}
+	
+	free(binned);
+	
+	for (int z=0; z<colour_palette_no; z++)
+	{
+		printf("colour palette of index %d is generated\n",z);
+	}
+}
+
+//Create a function to make the reduced colour palette of an image
+void BuildColourPalette(Uint32 * Quantized_Pixels, int w, int h, Uint32 colour_palette[][3], int colour_palette_no, const BenDayOptions *options, ThreadPool *pool)
+{
+	/*Parameters are...
+	Uint32 * Quantized_Pixels:	The pixels of the image.
 	int w:	The width of the image.
-	SDL_Surface* BluredSurface:	The surface which contains the image for light convolution blurring as well as for the results of the edge detection to be mapped on.
-	Uint32 *pixels:	The pixels to undergo light convolution blurring as well as for the results of the edge detection to be mapped on.
-	SDL_Surface* GreaterBluredSurface:	The surface which contains the image for heavy convolution blurring.
-	Uint32 *GBS_Pixels: The pixels to undergo heavy convolution blurring. */
+	int h:	The height of the image.
+	Uint32 colour_palette[][3]:	The 2D array which will store the reduced colour palette.
+	int colour_palette_no:	The number of colours in the colour palette.
+	const BenDayOptions *options:	The program options, which choose the quantization mode.
+	ThreadPool *pool:	The thread pool to share the work with.*/
 	
-	Uint32 *BlurValueArray, *HeavyBlurValueArray; //Creates array pointers.
+	Uint32 *colour = NULL; //Creates the packed colour array pointer
+	
+	//Introducing variables. The totalsize should depends on how many pixels that exist in the image, or how many are sampled.
+	Sint64 totalsize = (Sint64)w*h;
+	int sampling = options->palette_samples > 0 && options->palette_samples < totalsize;
+	if (sampling)
+	{
+		totalsize = options->palette_samples;
+	}
+	
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//Get the RGB values of the image into an array
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	
+	//Only the median cut over the pixels moves them around. The colour histogram is binned straight from the image,
+	//so the histogram quantizer does not take a copy of every pixel.
+	if (sampling || options->quantizer == QUANTIZER_EXACT)
+	{
+		//Malloc one contiguous colour array with a single packed Uint32 per pixel
+		colour = malloc(totalsize*sizeof(Uint32));
+		
+		if(colour == NULL)
+		{
+			printf("Insufficient memory\n");
+			exit(1);
+		}
+	}
+	
+	if (sampling)
+	{
+		//Build the colour palette from pixels spread over the whole image, so the time it takes does not depend on the image size
+		totalsize = StratifiedSample(Quantized_Pixels, w, h, totalsize, colour);
+	}
+	
+	else if (colour != NULL)
+	{
+		//Assigning the colour array with the RGB coordinates of the picture.
+		//The surfaces are ARGB8888, so the low 24 bits of a pixel already are its packed RGB value.
+		
+		Sint64 counting = 0;	// Variable to go through the colour array
+		
+		for (int y=0; y<h; y++)
+		{
+			for(int x=0; x<w; x++)
+			{
+			colour[counting] = Quantized_Pixels[(Sint64)y*w + x] & 0xFFFFFF;
+			counting++;
+			}
+		}
+	}
 	
 	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Light Convolution Blurring
 	
-	BlurValueArray = malloc(((h-1)*(w-1))*sizeof(Uint32));
+	//Without a copy the histogram quantizer bins the image itself, which it only reads
+	CutColourPalette((colour != NULL) ? colour : Quantized_Pixels, totalsize, NULL, 0, colour_palette, colour_palette_no, options, pool);
+	
+	free(colour);
+	colour = NULL;
+}
+
+//What a colour palette is made from. A decoded image gives its pixels. An image read a strip at a time gives what was
+//gathered from it as it was read, as its pixels are never all in memory at once.
+typedef struct PaletteSource
+{
+	Uint32 *pixels;	//The pixels of the decoded image, or NULL if it is read a strip at a time
+	int w;	//The width of the image
+	int h;	//The height of the image
+	Uint32 *samples;	//Without pixels, the pixels StratifiedSample picks for --palette-samples, or NULL
+	Sint64 sample_count;	//The number of samples
+	HistogramCell *cells;	//Without pixels or samples, the colour histogram of every pixel with the non empty cells at the front
+	int cellcount;	//The number of non empty cells
+	Uint32 error_samples[PALETTE_ERROR_SAMPLES];	//Without pixels, the pixels SampledPaletteError picks, for --palette-reuse
+	int error_count;	//The number of error samples
+} PaletteSource;
+
+//Create a function to estimate how well a colour palette fits the image a palette source comes from
+double SourcePaletteError(const PaletteSource *source, Uint32 colour_palette[][3], const InverseColourMap *colourmap)
+{
+	/*Parameters are...
+	const PaletteSource *source:	What the colour palette of the image is made from.
+	Uint32 colour_palette[][3]:	The colour palette.
+	const InverseColourMap *colourmap:	The inverse colour map of the colour palette.
+	Returns the root mean square distance between the sampled pixels and their closest colour_palette entry.*/
+	
+	if (source->pixels != NULL)
+	{
+		return SampledPaletteError(source->pixels, source->w, source->h, colour_palette, colourmap);
+	}
+	return PaletteError((Uint32 *) source->error_samples, source->error_count, colour_palette, colourmap);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Per pixel kernels. Each has a scalar version and SSE2, AVX2 and AVX-512 versions, and the widest one the CPU has is picked at startup.
+//Every version gives exactly the same result.
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+//The colours BenDay turns colours close to red/blue/yellow/black/white into
+#define BENDAY_RED 0xFFC80000
+#define BENDAY_BLUE 0xFF0028AA
+#define BENDAY_YELLOW 0xFFFADC64
+#define BENDAY_BLACK 0xFF000000
+#define BENDAY_WHITE 0xFFFFFFFF
+
+//Create a function to copy the grey values of part of a row of grey pixels into 8 bits
+void GreyRange(const Uint32 *line, Uint8 *grey, int start, int end)
+{
+	/*Parameters are...
+	const Uint32 *line:	The grey pixels of the row. The blue channel is used as the grey value.
+	Uint8 *grey:	The array which will store the grey values.
+	int start:	The first pixel to copy.
+	int end:	The last pixel +1 to copy.*/
+	
+	for (int x=start; x<end; x++)
+	{
+		grey[x] = line[x] & 0xFF;
+	}
+}
+
+//Create a function to blur part of a row of grey values with both kernels of the edge detection
+void BlurRange(const Uint8 *padded, Uint16 *light, Uint16 *heavy, int start, int end)
+{
+	/*Parameters are...
+	const Uint8 *padded:	The grey values of the row with two repeated values on either side, so padded[x+2] is pixel x.
+	Uint16 *light:	The array which will store the row blured with 1-2-1.
+	Uint16 *heavy:	The array which will store the row blured with 1-4-6-4-1.
+	int start:	The first pixel to blur.
+	int end:	The last pixel +1 to blur.*/
+	
+	for (int x=start; x<end; x++)
+	{
+		light[x] = padded[x+1] + 2*padded[x+2] + padded[x+3];
+		heavy[x] = padded[x] + 4*padded[x+1] + 6*padded[x+2] + 4*padded[x+3] + padded[x+4];
+	}
+}
+
+//Create a function to blur part of a row down the columns and keep the sign of the heavy blur minus the light blur
+void SignRange(const Uint16 *const light[3], const Uint16 *const heavy[5], Sint8 *sign, int start, int end)
+{
+	/*Parameters are...
+	const Uint16 *const light[3]:	The rows above, at and below the row, blured along the rows with 1-2-1.
+	const Uint16 *const heavy[5]:	The rows from two above to two below the row, blured along the rows with 1-4-6-4-1.
+	Sint8 *sign:	The array which will store 1, 0 or -1 for every pixel.
+	int start:	The first pixel to work out.
+	int end:	The last pixel +1 to work out.
+	
+	Both blurs are rounded once, to 8 bits, before they are compared.*/
+	
+	for (int x=start; x<end; x++)
+	{
+		int lightvalue = (8 + light[0][x] + 2*light[1][x] + light[2][x])>>4;
+		int heavyvalue = (128 + heavy[0][x] + 4*heavy[1][x] + 6*heavy[2][x] + 4*heavy[3][x] + heavy[4][x])>>8;
+		sign[x] = (heavyvalue>lightvalue) - (heavyvalue<lightvalue);
+	}
+}
+
+//Create a function to mark the edges in part of a row from the signs of the difference of gaussians
+void MarkEdgeRange(const Sint8 *up, const Sint8 *row, const Sint8 *down, Uint32 *out, int w, int start, int end)
+{
+	/*Parameters are...
+	const Sint8 *up:	The signs of the row above. On the first row this is the row itself.
+	const Sint8 *row:	The signs of the row.
+	const Sint8 *down:	The signs of the row below. On the last row this is the row itself.
+	Uint32 *out:	The pixels which will store black on the edges and white elsewhere.
+	int w:	The width of the image.
+	int start:	The first pixel to mark.
+	int end:	The last pixel +1 to mark.
+	
+	An edge is a positive pixel next to a negative one. A pixel on the border is compared with itself
+	in place of the missing neighbour, which can never be a change of sign.*/
+	
+	for(int x=start; x<end; x++)
+	{
+	int left = (x>0) ? row[x-1] : row[x];
+	int right = (x<w-1) ? row[x+1] : row[x];
+	int edge = row[x]>0 && (left<0 || right<0 || up[x]<0 || down[x]<0);
+	out[x] = edge ? BENDAY_BLACK : BENDAY_WHITE;
+	}
+}
+
+//How a pixel of the template counts for the Ben Day colours, from which of its red, green and blue are 255.
+//0 is white, 1 is a colour with none of them 255, and 2 is anything in between, which leaves the colour as it is.
+const Uint8 DotKinds[8] = {1, 2, 2, 2, 2, 2, 2, 0};
+#define DOT_KIND(dot) DotKinds[(CHANNEL(dot,0)==255) | (CHANNEL(dot,1)==255)<<1 | (CHANNEL(dot,2)==255)<<2]
+
+//Create a function to give part of a row its Ben Day colours
+void BenDayRange(const Uint8 *index, const Uint32 *dots, const Uint32 *classes, Uint32 *out, int start, int end)
+{
+	/*Parameters are...
+	const Uint8 *index:	The palette index of every pixel of the colour quantized row.
+	const Uint32 *dots:	The pixels of the Ben Day Dots template.
+	const Uint32 *classes:	The Ben Day colour of every palette colour for every kind of template pixel, 4 to a colour. See ClassifyPalette.
+	Uint32 *out:	The array which will store the Ben Day pixels.
+	int start:	The first pixel to convert.
+	int end:	The last pixel +1 to convert.*/
+	
+	for (int x=start; x<end; x++)
+	{
+		out[x] = classes[4*index[x] + DOT_KIND(dots[x])];
+	}
+}
+
+//Create a function to pack the black pixels of part of a row into bits, 64 pixels to a word
+void PackEdgeRange(const Uint32 *line, Uint64 *bits, int w, int start, int end)
+{
+	/*Parameters are...
+	const Uint32 *line:	The pixels of the row of the edge detection.
+	Uint64 *bits:	The array which will store the bits, bit x%64 of word x/64 set where pixel x is black.
+	int w:	The width of the row.
+	int start:	The first word to pack.
+	int end:	The last word +1 to pack.*/
+	
+	for (int i=start; i<end; i++)
+	{
+		Uint64 word = 0;
+		int count = (w-64*i < 64) ? w-64*i : 64;
+		for (int b=0; b<count; b++)
+		{
+			word |= (Uint64)((line[64*i+b] & 0xFFFFFF) == 0) << b;
+		}
+		bits[i] = word;
+	}
+}
+
+//Multiply two channels of 0 to 255 as fractions of 255, rounded to the closest. (a*b+127)/255 is done without a division,
+//as x/255 is (x+1 + (x+1)/256)/256 for every x up to 255*255+127.
+#define MULTIPLY_255(a,b) ((((a)*(b)+128) + (((a)*(b)+128) >> 8)) >> 8)
+
+//Create a function to multiply part of a row with the edge detection, every channel as a fraction of 255
+void MultiplyRange(const Uint32 *line, Uint32 *out, int start, int end)
+{
+	/*Parameters are...
+	const Uint32 *line:	The pixels of the row of the edge detection.
+	Uint32 *out:	The pixels of the row which are colour quantized and/or have the benday implemented. They are multiplied in place.
+	int start:	The first pixel to multiply.
+	int end:	The last pixel +1 to multiply.*/
+	
+	for (int x=start; x<end; x++)
+	{
+		Uint32 pixel = 0;
+		for (int shift=0; shift<32; shift+=8)
+		{
+			pixel |= (Uint32)MULTIPLY_255((line[x] >> shift) & 0xFF, (out[x] >> shift) & 0xFF) << shift;
+		}
+		out[x] = pixel;
+	}
+}
+
+//Create the scalar versions of the kernels which work on a whole row
+void GreyRowScalar(const Uint32 *line, Uint8 *grey, int w)
+{
+	GreyRange(line, grey, 0, w);
+}
+
+void BlurRowScalar(const Uint8 *padded, Uint16 *light, Uint16 *heavy, int w)
+{
+	BlurRange(padded, light, heavy, 0, w);
+}
+
+void SignRowScalar(const Uint16 *const light[3], const Uint16 *const heavy[5], Sint8 *sign, int w)
+{
+	SignRange(light, heavy, sign, 0, w);
+}
+
+void MarkEdgeRowScalar(const Sint8 *up, const Sint8 *row, const Sint8 *down, Uint32 *out, int w)
+{
+	MarkEdgeRange(up, row, down, out, w, 0, w);
+}
+
+void BenDayRowScalar(const Uint8 *index, const Uint32 *dots, const Uint32 *classes, Uint32 *out, int w)
+{
+	BenDayRange(index, dots, classes, out, 0, w);
+}
+
+void PackEdgeRowScalar(const Uint32 *line, Uint64 *bits, int w)
+{
+	PackEdgeRange(line, bits, w, 0, (w+63)/64);
+}
+
+void MultiplyRowScalar(const Uint32 *line, Uint32 *out, int w)
+{
+	MultiplyRange(line, out, 0, w);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BENDAY_X86 1
+//The vector versions. Each one does as many whole vectors as fit and leaves the rest of the row to the scalar version.
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//SSE2, 16 bytes at a time
+
+__attribute__((target("sse2"))) void GreyRowSSE2(const Uint32 *line, Uint8 *grey, int w)
+{
+	__m128i mask = _mm_set1_epi32(0xFF);
+	int x = 0;
+	for (; x+16<=w; x+=16)
+	{
+		__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(line+x)), mask);
+		__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(line+x+4)), mask);
+		__m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i*)(line+x+8)), mask);
+		__m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i*)(line+x+12)), mask);
+		_mm_storeu_si128((__m128i*)(grey+x), _mm_packus_epi16(_mm_packs_epi32(a,b), _mm_packs_epi32(c,d)));
+	}
+	GreyRange(line, grey, x, w);
+}
+
+__attribute__((target("sse2"))) void BlurRowSSE2(const Uint8 *padded, Uint16 *light, Uint16 *heavy, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i six = _mm_set1_epi16(6);
+	int x = 0;
+	for (; x+8<=w; x+=8)
+	{
+		__m128i p0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(padded+x)), zero);
+		__m128i p1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(padded+x+1)), zero);
+		__m128i p2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(padded+x+2)), zero);
+		__m128i p3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(padded+x+3)), zero);
+		__m128i p4 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(padded+x+4)), zero);
+		
+		__m128i lightsum = _mm_add_epi16(_mm_add_epi16(p1, p3), _mm_slli_epi16(p2, 1));
+		__m128i heavysum = _mm_add_epi16(_mm_add_epi16(p0, p4), _mm_add_epi16(_mm_slli_epi16(_mm_add_epi16(p1, p3), 2), _mm_mullo_epi16(p2, six)));
+		_mm_storeu_si128((__m128i*)(light+x), lightsum);
+		_mm_storeu_si128((__m128i*)(heavy+x), heavysum);
+	}
+	BlurRange(padded, light, heavy, x, w);
+}
+
+__attribute__((target("sse2"))) void SignRowSSE2(const Uint16 *const light[3], const Uint16 *const heavy[5], Sint8 *sign, int w)
+{
+	//The heavy sum is at most 128+16*4080 = 65408, so it fits in 16 bits without a sign
+	__m128i six = _mm_set1_epi16(6);
+	int x = 0;
+	for (; x+16<=w; x+=16)
+	{
+		__m128i half[2];
+		for (int i=0; i<2; i++)
+		{
+			int at = x+8*i;
+			__m128i l0 = _mm_loadu_si128((const __m128i*)(light[0]+at));
+			__m128i l1 = _mm_loadu_si128((const __m128i*)(light[1]+at));
+			__m128i l2 = _mm_loadu_si128((const __m128i*)(light[2]+at));
+			__m128i h0 = _mm_loadu_si128((const __m128i*)(heavy[0]+at));
+			__m128i h1 = _mm_loadu_si128((const __m128i*)(heavy[1]+at));
+			__m128i h2 = _mm_loadu_si128((const __m128i*)(heavy[2]+at));
+			__m128i h3 = _mm_loadu_si128((const __m128i*)(heavy[3]+at));
+			__m128i h4 = _mm_loadu_si128((const __m128i*)(heavy[4]+at));
+			
+			__m128i lightvalue = _mm_add_epi16(_mm_add_epi16(l0, l2), _mm_add_epi16(_mm_slli_epi16(l1, 1), _mm_set1_epi16(8)));
+			lightvalue = _mm_srli_epi16(lightvalue, 4);
+			__m128i heavyvalue = _mm_add_epi16(_mm_add_epi16(h0, h4), _mm_add_epi16(_mm_slli_epi16(_mm_add_epi16(h1, h3), 2), _mm_mullo_epi16(h2, six)));
+			heavyvalue = _mm_srli_epi16(_mm_add_epi16(heavyvalue, _mm_set1_epi16(128)), 8);
+			
+			//The compare masks are -1 where true, so less-than minus greater-than is the sign
+			half[i] = _mm_sub_epi16(_mm_cmplt_epi16(heavyvalue, lightvalue), _mm_cmpgt_epi16(heavyvalue, lightvalue));
+		}
+		_mm_storeu_si128((__m128i*)(sign+x), _mm_packs_epi16(half[0], half[1]));
+	}
+	SignRange(light, heavy, sign, x, w);
+}
+
+__attribute__((target("sse2"))) void MarkEdgeRowSSE2(const Sint8 *up, const Sint8 *row, const Sint8 *down, Uint32 *out, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i white = _mm_set1_epi32(BENDAY_WHITE);
+	__m128i colour = _mm_set1_epi32(0xFFFFFF);
+	
+	//The first pixel has no left neighbour, so the vectors start at the second and stop before the last
+	MarkEdgeRange(up, row, down, out, w, 0, (w<1) ? w : 1);
+	int x = 1;
+	for (; x+16<=w-1; x+=16)
+	{
+		__m128i centre = _mm_loadu_si128((const __m128i*)(row+x));
+		__m128i negative = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(_mm_loadu_si128((const __m128i*)(row+x-1)), zero),
+			_mm_cmplt_epi8(_mm_loadu_si128((const __m128i*)(row+x+1)), zero)),
+			_mm_or_si128(_mm_cmplt_epi8(_mm_loadu_si128((const __m128i*)(up+x)), zero),
+			_mm_cmplt_epi8(_mm_loadu_si128((const __m128i*)(down+x)), zero)));
+		__m128i edge = _mm_and_si128(_mm_cmpgt_epi8(centre, zero), negative);
+		
+		//Widen the byte masks to the pixels, and clear the colour of the edge pixels to get black
+		__m128i low = _mm_unpacklo_epi8(edge, edge);
+		__m128i high = _mm_unpackhi_epi8(edge, edge);
+		_mm_storeu_si128((__m128i*)(out+x), _mm_xor_si128(white, _mm_and_si128(_mm_unpacklo_epi16(low, low), colour)));
+		_mm_storeu_si128((__m128i*)(out+x+4), _mm_xor_si128(white, _mm_and_si128(_mm_unpackhi_epi16(low, low), colour)));
+		_mm_storeu_si128((__m128i*)(out+x+8), _mm_xor_si128(white, _mm_and_si128(_mm_unpacklo_epi16(high, high), colour)));
+		_mm_storeu_si128((__m128i*)(out+x+12), _mm_xor_si128(white, _mm_and_si128(_mm_unpackhi_epi16(high, high), colour)));
+	}
+	MarkEdgeRange(up, row, down, out, w, x, w);
+}
+
+__attribute__((target("sse2"))) void PackEdgeRowSSE2(const Uint32 *line, Uint64 *bits, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i colour = _mm_set1_epi32(0xFFFFFF);
+	int i = 0;
+	for (; 64*i+64<=w; i++)
+	{
+		//Narrow the masks of 16 pixels to bytes, so one movemask gives 16 bits
+		Uint64 word = 0;
+		for (int k=0; k<64; k+=16)
+		{
+			const Uint32 *p = line+64*i+k;
+			#define BLACK(n) _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(p+(n))), colour), zero)
+			__m128i mask = _mm_packs_epi16(_mm_packs_epi32(BLACK(0), BLACK(4)), _mm_packs_epi32(BLACK(8), BLACK(12)));
+			#undef BLACK
+			word |= (Uint64)(Uint16)_mm_movemask_epi8(mask) << k;
+		}
+		bits[i] = word;
+	}
+	PackEdgeRange(line, bits, w, i, (w+63)/64);
+}
+
+__attribute__((target("sse2"))) void MultiplyRowSSE2(const Uint32 *line, Uint32 *out, int w)
+{
+	//Every channel is widened to 16 bits, where the product and the rounding fit
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(128);
+	int x = 0;
+	for (; x+4<=w; x+=4)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(line+x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(out+x));
+		__m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)), round);
+		__m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)), round);
+		low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+		high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+		_mm_storeu_si128((__m128i*)(out+x), _mm_packus_epi16(low, high));
+	}
+	MultiplyRange(line, out, x, w);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//AVX2, 32 bytes at a time
+
+__attribute__((target("avx2"))) void GreyRowAVX2(const Uint32 *line, Uint8 *grey, int w)
+{
+	__m256i mask = _mm256_set1_epi32(0xFF);
+	int x = 0;
+	for (; x+32<=w; x+=32)
+	{
+		__m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(line+x)), mask);
+		__m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(line+x+8)), mask);
+		__m256i c = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(line+x+16)), mask);
+		__m256i d = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(line+x+24)), mask);
+		
+		//The packs work inside each 128 bit lane, so the 64 bit blocks are put back in order after each one
+		__m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3,1,2,0));
+		__m256i cd = _mm256_permute4x64_epi64(_mm256_packs_epi32(c, d), _MM_SHUFFLE(3,1,2,0));
+		__m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(ab, cd), _MM_SHUFFLE(3,1,2,0));
+		_mm256_storeu_si256((__m256i*)(grey+x), bytes);
+	}
+	GreyRange(line, grey, x, w);
+}
+
+__attribute__((target("avx2"))) void BlurRowAVX2(const Uint8 *padded, Uint16 *light, Uint16 *heavy, int w)
+{
+	__m256i six = _mm256_set1_epi16(6);
+	int x = 0;
+	for (; x+16<=w; x+=16)
+	{
+		__m256i p0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(padded+x)));
+		__m256i p1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(padded+x+1)));
+		__m256i p2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(padded+x+2)));
+		__m256i p3 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(padded+x+3)));
+		__m256i p4 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(padded+x+4)));
+		
+		__m256i lightsum = _mm256_add_epi16(_mm256_add_epi16(p1, p3), _mm256_slli_epi16(p2, 1));
+		__m256i heavysum = _mm256_add_epi16(_mm256_add_epi16(p0, p4), _mm256_add_epi16(_mm256_slli_epi16(_mm256_add_epi16(p1, p3), 2), _mm256_mullo_epi16(p2, six)));
+		_mm256_storeu_si256((__m256i*)(light+x), lightsum);
+		_mm256_storeu_si256((__m256i*)(heavy+x), heavysum);
+	}
+	BlurRange(padded, light, heavy, x, w);
+}
+
+__attribute__((target("avx2"))) void SignRowAVX2(const Uint16 *const light[3], const Uint16 *const heavy[5], Sint8 *sign, int w)
+{
+	__m256i six = _mm256_set1_epi16(6);
+	int x = 0;
+	for (; x+32<=w; x+=32)
+	{
+		__m256i half[2];
+		for (int i=0; i<2; i++)
+		{
+			int at = x+16*i;
+			__m256i l0 = _mm256_loadu_si256((const __m256i*)(light[0]+at));
+			__m256i l1 = _mm256_loadu_si256((const __m256i*)(light[1]+at));
+			__m256i l2 = _mm256_loadu_si256((const __m256i*)(light[2]+at));
+			__m256i h0 = _mm256_loadu_si256((const __m256i*)(heavy[0]+at));
+			__m256i h1 = _mm256_loadu_si256((const __m256i*)(heavy[1]+at));
+			__m256i h2 = _mm256_loadu_si256((const __m256i*)(heavy[2]+at));
+			__m256i h3 = _mm256_loadu_si256((const __m256i*)(heavy[3]+at));
+			__m256i h4 = _mm256_loadu_si256((const __m256i*)(heavy[4]+at));
+			
+			__m256i lightvalue = _mm256_add_epi16(_mm256_add_epi16(l0, l2), _mm256_add_epi16(_mm256_slli_epi16(l1, 1), _mm256_set1_epi16(8)));
+			lightvalue = _mm256_srli_epi16(lightvalue, 4);
+			__m256i heavyvalue = _mm256_add_epi16(_mm256_add_epi16(h0, h4), _mm256_add_epi16(_mm256_slli_epi16(_mm256_add_epi16(h1, h3), 2), _mm256_mullo_epi16(h2, six)));
+			heavyvalue = _mm256_srli_epi16(_mm256_add_epi16(heavyvalue, _mm256_set1_epi16(128)), 8);
+			
+			half[i] = _mm256_sub_epi16(_mm256_cmpgt_epi16(lightvalue, heavyvalue), _mm256_cmpgt_epi16(heavyvalue, lightvalue));
+		}
+		__m256i bytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(half[0], half[1]), _MM_SHUFFLE(3,1,2,0));
+		_mm256_storeu_si256((__m256i*)(sign+x), bytes);
+	}
+	SignRange(light, heavy, sign, x, w);
+}
+
+__attribute__((target("avx2"))) void MarkEdgeRowAVX2(const Sint8 *up, const Sint8 *row, const Sint8 *down, Uint32 *out, int w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i white = _mm256_set1_epi32(BENDAY_WHITE);
+	__m256i colour = _mm256_set1_epi32(0xFFFFFF);
+	
+	MarkEdgeRange(up, row, down, out, w, 0, (w<1) ? w : 1);
+	int x = 1;
+	for (; x+32<=w-1; x+=32)
+	{
+		__m256i centre = _mm256_loadu_si256((const __m256i*)(row+x));
+		__m256i negative = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi8(zero, _mm256_loadu_si256((const __m256i*)(row+x-1))),
+			_mm256_cmpgt_epi8(zero, _mm256_loadu_si256((const __m256i*)(row+x+1)))),
+			_mm256_or_si256(_mm256_cmpgt_epi8(zero, _mm256_loadu_si256((const __m256i*)(up+x))),
+			_mm256_cmpgt_epi8(zero, _mm256_loadu_si256((const __m256i*)(down+x)))));
+		__m256i edge = _mm256_and_si256(_mm256_cmpgt_epi8(centre, zero), negative);
+		
+		//Sign extending the byte masks widens them to the pixels
+		__m128i low = _mm256_castsi256_si128(edge);
+		__m128i high = _mm256_extracti128_si256(edge, 1);
+		_mm256_storeu_si256((__m256i*)(out+x), _mm256_xor_si256(white, _mm256_and_si256(_mm256_cvtepi8_epi32(low), colour)));
+		_mm256_storeu_si256((__m256i*)(out+x+8), _mm256_xor_si256(white, _mm256_and_si256(_mm256_cvtepi8_epi32(_mm_srli_si128(low, 8)), colour)));
+		_mm256_storeu_si256((__m256i*)(out+x+16), _mm256_xor_si256(white, _mm256_and_si256(_mm256_cvtepi8_epi32(high), colour)));
+		_mm256_storeu_si256((__m256i*)(out+x+24), _mm256_xor_si256(white, _mm256_and_si256(_mm256_cvtepi8_epi32(_mm_srli_si128(high, 8)), colour)));
+	}
+	MarkEdgeRange(up, row, down, out, w, x, w);
+}
+
+__attribute__((target("avx2"))) void BenDayRowAVX2(const Uint8 *index, const Uint32 *dots, const Uint32 *classes, Uint32 *out, int w)
+{
+	__m256i full = _mm256_set1_epi32(255);
+	__m256i two = _mm256_set1_epi32(2);
+	int x = 0;
+	for (; x+8<=w; x+=8)
+	{
+		__m256i dot = _mm256_loadu_si256((const __m256i*)(dots+x));
+		__m256i r = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_srli_epi32(dot, 16), full), full);
+		__m256i g = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_srli_epi32(dot, 8), full), full);
+		__m256i b = _mm256_cmpeq_epi32(_mm256_and_si256(dot, full), full);
+		
+		//The masks are -1 where set, so 2 + 2*white + coloured is 0 for white, 1 for coloured and 2 otherwise
+		__m256i white = _mm256_and_si256(_mm256_and_si256(r, g), b);
+		__m256i coloured = _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(r, g), b), _mm256_set1_epi32(-1));
+		__m256i kind = _mm256_add_epi32(_mm256_add_epi32(two, _mm256_add_epi32(white, white)), coloured);
+		
+		__m256i entry = _mm256_add_epi32(_mm256_slli_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(index+x))), 2), kind);
+		_mm256_storeu_si256((__m256i*)(out+x), _mm256_i32gather_epi32((const int*)classes, entry, 4));
+	}
+	BenDayRange(index, dots, classes, out, x, w);
+}
+
+__attribute__((target("avx2"))) void PackEdgeRowAVX2(const Uint32 *line, Uint64 *bits, int w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i colour = _mm256_set1_epi32(0xFFFFFF);
+	int i = 0;
+	for (; 64*i+64<=w; i++)
+	{
+		Uint64 word = 0;
+		for (int k=0; k<64; k+=8)
+		{
+			__m256i black = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(line+64*i+k)), colour), zero);
+			word |= (Uint64)(Uint8)_mm256_movemask_ps(_mm256_castsi256_ps(black)) << k;
+		}
+		bits[i] = word;
+	}
+	PackEdgeRange(line, bits, w, i, (w+63)/64);
+}
+
+__attribute__((target("avx2"))) void MultiplyRowAVX2(const Uint32 *line, Uint32 *out, int w)
+{
+	//The unpacks and the pack both work within each 16 byte half, so the pixels come back in order
+	__m256i zero = _mm256_setzero_si256();
+	__m256i round = _mm256_set1_epi16(128);
+	int x = 0;
+	for (; x+8<=w; x+=8)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(line+x));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(out+x));
+		__m256i low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero)), round);
+		__m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero)), round);
+		low = _mm256_srli_epi16(_mm256_add_epi16(low, _mm256_srli_epi16(low, 8)), 8);
+		high = _mm256_srli_epi16(_mm256_add_epi16(high, _mm256_srli_epi16(high, 8)), 8);
+		_mm256_storeu_si256((__m256i*)(out+x), _mm256_packus_epi16(low, high));
+	}
+	MultiplyRange(line, out, x, w);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//AVX-512, 16 values of 32 bits at a time. Only AVX-512F is used, so the 8 and 16 bit values are widened to 32 bits.
+
+__attribute__((target("avx512f"))) void GreyRowAVX512(const Uint32 *line, Uint8 *grey, int w)
+{
+	int x = 0;
+	for (; x+16<=w; x+=16)
+	{
+		//Narrowing to 8 bits keeps the low byte, which is the blue channel
+		_mm_storeu_si128((__m128i*)(grey+x), _mm512_cvtepi32_epi8(_mm512_loadu_si512((const void*)(line+x))));
+	}
+	GreyRange(line, grey, x, w);
+}
+
+__attribute__((target("avx512f"))) void BlurRowAVX512(const Uint8 *padded, Uint16 *light, Uint16 *heavy, int w)
+{
+	__m512i six = _mm512_set1_epi32(6);
+	int x = 0;
+	for (; x+16<=w; x+=16)
+	{
+		__m512i p0 = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(padded+x)));
+		__m512i p1 = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(padded+x+1)));
+		__m512i p2 = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(padded+x+2)));
+		__m512i p3 = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(padded+x+3)));
+		__m512i p4 = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(padded+x+4)));
+		
+		__m512i lightsum = _mm512_add_epi32(_mm512_add_epi32(p1, p3), _mm512_slli_epi32(p2, 1));
+		__m512i heavysum = _mm512_add_epi32(_mm512_add_epi32(p0, p4), _mm512_add_epi32(_mm512_slli_epi32(_mm512_add_epi32(p1, p3), 2), _mm512_mullo_epi32(p2, six)));
+		_mm256_storeu_si256((__m256i*)(light+x), _mm512_cvtepi32_epi16(lightsum));
+		_mm256_storeu_si256((__m256i*)(heavy+x), _mm512_cvtepi32_epi16(heavysum));
+	}
+	BlurRange(padded, light, heavy, x, w);
+}
+
+__attribute__((target("avx512f"))) void SignRowAVX512(const Uint16 *const light[3], const Uint16 *const heavy[5], Sint8 *sign, int w)
+{
+	__m512i six = _mm512_set1_epi32(6);
+	int x = 0;
+	for (; x+16<=w; x+=16)
+	{
+		__m512i l0 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(light[0]+x)));
+		__m512i l1 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(light[1]+x)));
+		__m512i l2 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(light[2]+x)));
+		__m512i h0 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(heavy[0]+x)));
+		__m512i h1 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(heavy[1]+x)));
+		__m512i h2 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(heavy[2]+x)));
+		__m512i h3 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(heavy[3]+x)));
+		__m512i h4 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(heavy[4]+x)));
+		
+		__m512i lightvalue = _mm512_add_epi32(_mm512_add_epi32(l0, l2), _mm512_add_epi32(_mm512_slli_epi32(l1, 1), _mm512_set1_epi32(8)));
+		lightvalue = _mm512_srli_epi32(lightvalue, 4);
+		__m512i heavyvalue = _mm512_add_epi32(_mm512_add_epi32(h0, h4), _mm512_add_epi32(_mm512_slli_epi32(_mm512_add_epi32(h1, h3), 2), _mm512_mullo_epi32(h2, six)));
+		heavyvalue = _mm512_srli_epi32(_mm512_add_epi32(heavyvalue, _mm512_set1_epi32(128)), 8);
+		
+		__m512i value = _mm512_mask_mov_epi32(_mm512_setzero_si512(), _mm512_cmpgt_epi32_mask(heavyvalue, lightvalue), _mm512_set1_epi32(1));
+		value = _mm512_mask_mov_epi32(value, _mm512_cmplt_epi32_mask(heavyvalue, lightvalue), _mm512_set1_epi32(-1));
+		_mm_storeu_si128((__m128i*)(sign+x), _mm512_cvtepi32_epi8(value));
+	}
+	SignRange(light, heavy, sign, x, w);
+}
+
+__attribute__((target("avx512f"))) void MarkEdgeRowAVX512(const Sint8 *up, const Sint8 *row, const Sint8 *down, Uint32 *out, int w)
+{
+	__m512i zero = _mm512_setzero_si512();
+	__m512i white = _mm512_set1_epi32(BENDAY_WHITE);
+	__m512i black = _mm512_set1_epi32(BENDAY_BLACK);
+	
+	MarkEdgeRange(up, row, down, out, w, 0, (w<1) ? w : 1);
+	int x = 1;
+	for (; x+16<=w-1; x+=16)
+	{
+		#define SIGNS(p) _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(p)))
+		__mmask16 negative = _mm512_cmplt_epi32_mask(SIGNS(row+x-1), zero) | _mm512_cmplt_epi32_mask(SIGNS(row+x+1), zero)
+			| _mm512_cmplt_epi32_mask(SIGNS(up+x), zero) | _mm512_cmplt_epi32_mask(SIGNS(down+x), zero);
+		__mmask16 edge = _mm512_cmpgt_epi32_mask(SIGNS(row+x), zero) & negative;
+		#undef SIGNS
+		
+		_mm512_storeu_si512((void*)(out+x), _mm512_mask_mov_epi32(white, edge, black));
+	}
+	MarkEdgeRange(up, row, down, out, w, x, w);
+}
+
+__attribute__((target("avx512f"))) void BenDayRowAVX512(const Uint8 *index, const Uint32 *dots, const Uint32 *classes, Uint32 *out, int w)
+{
+	__m512i full = _mm512_set1_epi32(255);
+	int x = 0;
+	for (; x+16<=w; x+=16)
+	{
+		__m512i dot = _mm512_loadu_si512((const void*)(dots+x));
+		__mmask16 r = _mm512_cmpeq_epi32_mask(_mm512_and_si512(_mm512_srli_epi32(dot, 16), full), full);
+		__mmask16 g = _mm512_cmpeq_epi32_mask(_mm512_and_si512(_mm512_srli_epi32(dot, 8), full), full);
+		__mmask16 b = _mm512_cmpeq_epi32_mask(_mm512_and_si512(dot, full), full);
+		
+		__m512i kind = _mm512_mask_mov_epi32(_mm512_set1_epi32(2), r & g & b, _mm512_setzero_si512());
+		kind = _mm512_mask_mov_epi32(kind, (__mmask16)~(r | g | b), _mm512_set1_epi32(1));
+		
+		__m512i entry = _mm512_add_epi32(_mm512_slli_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(index+x))), 2), kind);
+		_mm512_storeu_si512((void*)(out+x), _mm512_i32gather_epi32(entry, (const int*)classes, 4));
+	}
+	BenDayRange(index, dots, classes, out, x, w);
+}
+__attribute__((target("avx512f"))) void PackEdgeRowAVX512(const Uint32 *line, Uint64 *bits, int w)
+{
+	__m512i colour = _mm512_set1_epi32(0xFFFFFF);
+	int i = 0;
+	for (; 64*i+64<=w; i++)
+	{
+		//The mask of the test is already one bit for every pixel
+		Uint64 word = 0;
+		for (int k=0; k<64; k+=16)
+		{
+			word |= (Uint64)_mm512_testn_epi32_mask(_mm512_loadu_si512((const void*)(line+64*i+k)), colour) << k;
+		}
+		bits[i] = word;
+	}
+	PackEdgeRange(line, bits, w, i, (w+63)/64);
+}
+#endif
+
+//The kernels picked for the CPU
+typedef struct PixelKernels
+{
+	int simd;	//SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 or SIMD_AVX512
+	void (*grey_row)(const Uint32 *line, Uint8 *grey, int w);
+	void (*blur_row)(const Uint8 *padded, Uint16 *light, Uint16 *heavy, int w);
+	void (*sign_row)(const Uint16 *const light[3], const Uint16 *const heavy[5], Sint8 *sign, int w);
+	void (*mark_edge_row)(const Sint8 *up, const Sint8 *row, const Sint8 *down, Uint32 *out, int w);
+	void (*benday_row)(const Uint8 *index, const Uint32 *dots, const Uint32 *classes, Uint32 *out, int w);
+	void (*pack_edge_row)(const Uint32 *line, Uint64 *bits, int w);
+	void (*multiply_row)(const Uint32 *line, Uint32 *out, int w);
+} PixelKernels;
+
+PixelKernels Kernels = {SIMD_SCALAR, GreyRowScalar, BlurRowScalar, SignRowScalar, MarkEdgeRowScalar, BenDayRowScalar, PackEdgeRowScalar, MultiplyRowScalar};
+
+//Create a function to pick the widest kernels the CPU can run
+void SelectPixelKernels(int widest)
+{
+	/*Parameters are...
+	int widest:	The widest instruction set that may be used, SIMD_SCALAR up to SIMD_AVX512.*/
+	
+	PixelKernels scalar = {SIMD_SCALAR, GreyRowScalar, BlurRowScalar, SignRowScalar, MarkEdgeRowScalar, BenDayRowScalar, PackEdgeRowScalar, MultiplyRowScalar};
+	Kernels = scalar;
+	
+#ifdef BENDAY_X86
+	if (widest >= SIMD_AVX512 && SDL_HasAVX512F())
+	{
+		//AVX-512F has no 16 bit multiply, so the multiply blend uses the AVX2 kernel
+		PixelKernels avx512 = {SIMD_AVX512, GreyRowAVX512, BlurRowAVX512, SignRowAVX512, MarkEdgeRowAVX512, BenDayRowAVX512, PackEdgeRowAVX512, MultiplyRowAVX2};
+		Kernels = avx512;
+	}
+	else if (widest >= SIMD_AVX2 && SDL_HasAVX2())
+	{
+		PixelKernels avx2 = {SIMD_AVX2, GreyRowAVX2, BlurRowAVX2, SignRowAVX2, MarkEdgeRowAVX2, BenDayRowAVX2, PackEdgeRowAVX2, MultiplyRowAVX2};
+		Kernels = avx2;
+	}
+	else if (widest >= SIMD_SSE2 && SDL_HasSSE2())
+	{
+		//SSE2 has no gather, so the Ben Day lookup stays scalar
+		PixelKernels sse2 = {SIMD_SSE2, GreyRowSSE2, BlurRowSSE2, SignRowSSE2, MarkEdgeRowSSE2, BenDayRowScalar, PackEdgeRowSSE2, MultiplyRowSSE2};
+		Kernels = sse2;
+	}
+#endif
+	
+	const char *names[4] = {"scalar", "SSE2", "AVX2", "AVX-512"};
+	printf("Using the %s pixel kernels\n", names[Kernels.simd]);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Built in Ben Day dot screen, used when no template image is given.
+//The dots come from a small tile of thresholds over one cell of the screen, looked up per pixel,
+//so they stay sharp at any size of image and the template surface is not needed.
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define HALFTONE_TILE_BITS 6
+#define HALFTONE_TILE (1<<HALFTONE_TILE_BITS)	//Samples across one cell of the screen
+
+typedef struct HalftoneScreen
+{
+	Uint8 threshold[HALFTONE_TILE*HALFTONE_TILE];	//The order the samples of a cell are inked in, from 0 to 255
+	Uint32 across[2];	//How far one pixel to the right moves in the cell, in 1/2^32 of a cell
+	Uint32 down[2];	//How far one pixel down moves in the cell, in 1/2^32 of a cell
+} HalftoneScreen;
+
+typedef struct SpotSample
+{
+	double spot;
+	int index;
+} SpotSample;
+
+//Create a function to compare samples of a cell, the one inked first coming first
+int compSpot(const void *x,const void *y)
+{
+	const SpotSample *a = x, *b = y;
+	if (a->spot != b->spot) return (a->spot < b->spot) ? 1 : -1;
+	return a->index - b->index;
+}
+
+//Create a function to make the dot screen
+void BuildHalftoneScreen(HalftoneScreen *screen, double pitch, double angle)
+{
+	/*Parameters are...
+	HalftoneScreen *screen:	The screen to be filled in.
+	double pitch:	The distance between the centres of the dots in pixels.
+	double angle:	The angle of the rows of dots in degrees.
+	
+	The samples of the cell are ranked by the spot function cos(2 pi u) + cos(2 pi v), which is highest in the middle of the cell.
+	So the dots grow round from the middle, meet at half coverage and then leave round white holes at the corners.
+	As the thresholds are ranks, the part of a cell that is inked is the same as the tone asked for.*/
+	
+	SpotSample *samples = malloc(HALFTONE_TILE*HALFTONE_TILE*sizeof(SpotSample));
+	
+	if(samples == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	for (int j=0; j<HALFTONE_TILE; j++)
+	{
+		for (int i=0; i<HALFTONE_TILE; i++)
+		{
+			double u = (i + 0.5)/HALFTONE_TILE - 0.5;
+			double v = (j + 0.5)/HALFTONE_TILE - 0.5;
+			samples[j*HALFTONE_TILE + i].spot = cos(2*M_PI*u) + cos(2*M_PI*v);
+			samples[j*HALFTONE_TILE + i].index = j*HALFTONE_TILE + i;
+		}
+	}
+	
+	qsort(samples, HALFTONE_TILE*HALFTONE_TILE, sizeof(SpotSample), compSpot);
+	for (int k=0; k<HALFTONE_TILE*HALFTONE_TILE; k++)
+	{
+		screen->threshold[samples[k].index] = (Uint8)(k*256/(HALFTONE_TILE*HALFTONE_TILE));
+	}
+	free(samples);
+	
+	//The steps wrap round at whole cells, so only the place in the cell is kept
+	double radians = angle*M_PI/180;
+	double c = cos(radians)/pitch, s = sin(radians)/pitch;
+	screen->across[0] = (Uint32)(Sint64)llround(c*4294967296.0);
+	screen->across[1] = (Uint32)(Sint64)llround(-s*4294967296.0);
+	screen->down[0] = (Uint32)(Sint64)llround(s*4294967296.0);
+	screen->down[1] = (Uint32)(Sint64)llround(c*4294967296.0);
+}
+
+//Create a function to work out a row of the dot screen for the BenDay kernels
+void HalftoneRow(const HalftoneScreen *screen, int y, const Uint8 *index, const Uint8 *darkness, const Uint8 *dark, Uint32 *dots, int w)
+{
+	/*Parameters are...
+	const HalftoneScreen *screen:	The dot screen.
+	int y:	The row of the image.
+	const Uint8 *index:	The palette index of every pixel of the row.
+	const Uint8 *darkness:	How dark every palette colour is, from 0 to 255.
+	const Uint8 *dark:	Set for the palette colours BenDay counts as dark.
+	Uint32 *dots:	The array which will store the row of the screen, in place of a row of a template image.
+	int w:	The width of the image.
+	
+	The dots are as big as the colour is dark, so a pixel keeps its colour where the threshold is below its darkness and turns white elsewhere.
+	BenDay keeps the colour of light pixels where the template is not white, and of dark pixels where it is white,
+	so the row is written in those terms.*/
+	
+	Uint32 u = (Uint32)y*screen->down[0];
+	Uint32 v = (Uint32)y*screen->down[1];
+	
+	for (int x=0; x<w; x++)
+	{
+		int threshold = screen->threshold[((v >> (32-HALFTONE_TILE_BITS)) << HALFTONE_TILE_BITS) | (u >> (32-HALFTONE_TILE_BITS))];
+		dots[x] = ((threshold < darkness[index[x]]) != dark[index[x]]) ? BENDAY_BLACK : BENDAY_WHITE;
+		u += screen->across[0];
+		v += screen->across[1];
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Ben Day Dots template given with --template. It is decoded once for the whole batch, and the
+//versions scaled to the size of each image are kept, so images of the same size share one.
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define TEMPLATE_CACHE_ENTRIES 16	//The most scaled templates kept, whatever their size
+
+typedef struct ScaledTemplate
+{
+	SDL_Surface *surface;	//The template scaled to the size of an image
+	Uint64 last_used;	//When it was last asked for, to find the least recently used one
+	int users;	//The number of images using it. It is only let go when this is 0.
+} ScaledTemplate;
+
+typedef struct TemplateCache
+{
+	SDL_Surface *template;	//The decoded template in ARGB8888
+	ScaledTemplate entries[TEMPLATE_CACHE_ENTRIES];
+	int count;	//The number of scaled templates kept
+	Sint64 bytes;	//The memory the scaled templates take
+	Sint64 limit;	//The most memory the scaled templates may take
+	Uint64 clock;	//Counts the requests, used as the time of last use
+	SDL_mutex *lock;	//Protects the scaled templates, as the images of a batch are worked on at the same time
+} TemplateCache;
+
+//Create a function to load the template and make an empty cache of scaled templates
+TemplateCache* CreateTemplateCache(const char *file, Sint64 limit)
+{
+	/*Parameters are...
+	const char *file:	The file of the Ben Day Dots template.
+	Sint64 limit:	The most memory in bytes the scaled templates may take.
+	Returns the cache, or NULL if the template cannot be loaded.*/
+	
+	SDL_Surface *loaded = IMG_Load(file);
+	if (!loaded)
+	{
+		return NULL;
+	}
+	
+	TemplateCache *cache = calloc(1, sizeof(TemplateCache));
+	if(cache == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	cache->template = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(loaded);
+	if (!cache->template)
+	{
+		free(cache);
+		return NULL;
+	}
+	
+	cache->limit = limit;
+	cache->lock = SDL_CreateMutex();
+	return cache;
+}
+
+//Create a function to scale some rows of the template to the size of an image
+void ScaleTemplateRows(const SDL_Surface *template, int w, int h, int top, int rows, Uint32 *pixels)
+{
+	/*Parameters are...
+	const SDL_Surface *template:	The decoded template in ARGB8888.
+	int w:	The width of the image.
+	int h:	The height of the image.
+	int top:	The first row of the image to scale the template for.
+	int rows:	The number of rows.
+	Uint32 *pixels:	The array which will store the scaled rows, w pixels to a row.
+	
+	Every pixel takes the template pixel nearest its middle. Each row picks its template row on its own,
+	so a strip of rows comes out the same as those rows of the whole scaled template.*/
+	
+	int *column = malloc(w*sizeof(int));	//The template column of every column of the image
+	if(column == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	for (int x=0; x<w; x++)
+	{
+		column[x] = (int)(((Sint64)2*x+1)*template->w/(2*w));
+	}
+	
+	for (int y=0; y<rows; y++)
+	{
+		int row = (int)(((Sint64)2*(top+y)+1)*template->h/(2*h));
+		const Uint32 *line = (const Uint32 *)((const Uint8 *)template->pixels + (Sint64)row*template->pitch);
+		Uint32 *out = pixels+(Sint64)y*w;
+		for (int x=0; x<w; x++)
+		{
+			out[x] = line[column[x]];
+		}
+	}
+	free(column);
+}
+
+//Create a function to give the template scaled to the size of an image
+SDL_Surface* GetScaledTemplate(TemplateCache *cache, int w, int h)
+{
+	/*Parameters are...
+	TemplateCache *cache:	The cache of scaled templates.
+	int w:	The width of the image.
+	int h:	The height of the image.
+	Returns the scaled template. It belongs to the cache and has to be given back with ReleaseScaledTemplate.
+	
+	A new size is scaled once and kept. Older sizes that no image is using are let go, the least recently used first,
+	until the new one fits the limit. The one being returned is always kept, even on its own over the limit,
+	unless every entry is in use, when it is freed as soon as it is given back.*/
+	
+	SDL_LockMutex(cache->lock);
+	cache->clock++;
+	for (int i=0; i<cache->count; i++)
+	{
+		if (cache->entries[i].surface->w == w && cache->entries[i].surface->h == h)
+		{
+			cache->entries[i].last_used = cache->clock;
+			cache->entries[i].users++;
+			SDL_UnlockMutex(cache->lock);
+			return cache->entries[i].surface;
+		}
+	}
+	
+	SDL_Surface *scaled = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+	if (!scaled)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	ScaleTemplateRows(cache->template, w, h, 0, h, (Uint32 *) scaled->pixels);
+	Sint64 size = (Sint64)scaled->pitch*h;
+	
+	while (cache->count == TEMPLATE_CACHE_ENTRIES || cache->bytes + size > cache->limit)
+	{
+		int oldest = -1;
+		for (int i=0; i<cache->count; i++)
+		{
+			if (cache->entries[i].users == 0 && (oldest < 0 || cache->entries[i].last_used < cache->entries[oldest].last_used)) oldest = i;
+		}
+		if (oldest < 0)
+		{
+			break;
+		}
+		cache->bytes -= (Sint64)cache->entries[oldest].surface->pitch*cache->entries[oldest].surface->h;
+		SDL_FreeSurface(cache->entries[oldest].surface);
+		cache->entries[oldest] = cache->entries[--cache->count];
+	}
+	
+	if (cache->count < TEMPLATE_CACHE_ENTRIES)
+	{
+		cache->entries[cache->count].surface = scaled;
+		cache->entries[cache->count].last_used = cache->clock;
+		cache->entries[cache->count].users = 1;
+		cache->count++;
+		cache->bytes += size;
+	}
+	SDL_UnlockMutex(cache->lock);
+	return scaled;
+}
+
+//Create a function to give back a scaled template once the image is done with it
+void ReleaseScaledTemplate(TemplateCache *cache, SDL_Surface *scaled)
+{
+	/*Parameters are...
+	TemplateCache *cache:	The cache of scaled templates.
+	SDL_Surface *scaled:	The scaled template from GetScaledTemplate.*/
+	
+	SDL_LockMutex(cache->lock);
+	for (int i=0; i<cache->count; i++)
+	{
+		if (cache->entries[i].surface == scaled)
+		{
+			cache->entries[i].users--;
+			SDL_UnlockMutex(cache->lock);
+			return;
+		}
+	}
+	SDL_UnlockMutex(cache->lock);
+	
+	//It was not kept, as the cache was full of templates in use
+	SDL_FreeSurface(scaled);
+}
+
+//Create a function to free the template and every scaled template
+void DestroyTemplateCache(TemplateCache *cache)
+{
+	/*Parameters are...
+	TemplateCache *cache:	The cache to free. It may be NULL.*/
+	
+	if (cache == NULL)
+	{
+		return;
+	}
+	
+	for (int i=0; i<cache->count; i++)
+	{
+		SDL_FreeSurface(cache->entries[i].surface);
+	}
+	SDL_FreeSurface(cache->template);
+	SDL_DestroyMutex(cache->lock);
+	free(cache);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Creating Working Functions
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//The pixels that MapPaletteBand gives the palette index of their closest colour to
+typedef struct PaletteBands
+{
+	const InverseColourMap *colourmap;	//The inverse colour map of the colour palette
+	Uint32 (*colour_palette)[3];	//The reduced colour palette
+	const Uint32 *Quantized_Pixels;	//The pixels to be quantized
+	Uint8 *Palette_Index;	//The array which will store the palette index of every pixel
+	int w;	//The width of the image
+} PaletteBands;
+
+void MapPaletteBand(void *data, int band, int start, int end)
+{
+	PaletteBands *mapping = data;
+	int w = mapping->w;
+	
+	for (int y=start; y<end; y++)
+	{
+		const Uint32 *line = mapping->Quantized_Pixels+(Sint64)y*w;
+		Uint8 *index = mapping->Palette_Index+(Sint64)y*w;
+		for(int x=0; x<w; x++)
+		{
+		//Set the pixel to the closest colour_palette
+		index[x] = NearestPaletteIndex(mapping->colourmap, mapping->colour_palette, line[x] & 0xFFFFFF);
+		}
+	}
+}
+
+//Create a function to make the colour palette of an image, or take the one of the previous image if it still fits
+InverseColourMap* ColourPalette(const PaletteSource *source, Uint32 colour_palette[][3], Uint32 *Palette_Colours, int colour_palette_no,
+	const BenDayOptions *options, ThreadPool *pool, PaletteCache *cache)
+{
+	/*Parameters are...
+	const PaletteSource *source:	What the colour palette is made from: the pixels to be quantized, which are not changed,
+					or what was gathered from them. The samples of an image read a strip at a time may be moved around.
+	Uint32 colour_palette[][3]:	The 2D array which will store the reduced colour palette.
+	Uint32 *Palette_Colours:	The array which will store the pixels of the colours of the palette.
+	int colour_palette_no:	The number of colours that will result after the colour quantization. It can be at most 256.
+	const BenDayOptions *options:	The program options, which choose the quantization mode and whether colour palettes are reused.
+	ThreadPool *pool:	The thread pool to share the work with.
+	PaletteCache *cache:	The colour palette kept from the previous image for this call. It is updated when a new colour palette is made.
+	Returns the inverse colour map of the colour palette, to be freed with FreeInverseColourMap.*/
+	
+	InverseColourMap *colourmap = NULL;
+	
+	//If the colour palette of the previous image still fits this image, skip the median cut and use it again
+	if (options->palette_reuse >= 0 && cache->valid && cache->colour_palette_no == colour_palette_no)
+	{
+		memcpy(colour_palette, cache->colour_palette, colour_palette_no*sizeof(colour_palette[0]));
+		colourmap = BuildInverseColourMap(colour_palette, colour_palette_no);
+		
+		double error = SourcePaletteError(source, colour_palette, colourmap);
+		if (error <= cache->error+options->palette_reuse)
+		{
+			printf("colour palette of the previous image is reused (sampled error %.2f, it was made with %.2f)\n", error, cache->error);
+		}
+		else
+		{
+			FreeInverseColourMap(colourmap);
+			colourmap = NULL;
+		}
+	}
+	
+	if (colourmap == NULL)
+	{
+		Uint64 start_time = SDL_GetPerformanceCounter();
+		if (source->pixels != NULL)
+		{
+			BuildColourPalette(source->pixels, source->w, source->h, colour_palette, colour_palette_no, options, pool);
+		}
+		else
+		{
+			CutColourPalette(source->samples, source->sample_count, source->cells, source->cellcount, colour_palette, colour_palette_no, options, pool);
+		}
+		double build_time = (double)(SDL_GetPerformanceCounter()-start_time)/SDL_GetPerformanceFrequency();
+		colourmap = BuildInverseColourMap(colour_palette, colour_palette_no);
+		
+		//Compare the sampled or k-means colour palette with the one the exact median cut makes from every pixel, over the whole image.
+		//It needs every pixel, so it is not made for an image read a strip at a time.
+		if (options->palette_report && (options->palette_samples > 0 || options->kmeans_iterations > 0) && source->pixels != NULL)
+		{
+			BenDayOptions exact_options = *options;
+			exact_options.quantizer = QUANTIZER_EXACT;
+			exact_options.palette_samples = 0;
+			exact_options.kmeans_iterations = 0;
+			
+			Uint32 exact_palette[256][3];
+			start_time = SDL_GetPerformanceCounter();
+			BuildColourPalette(source->pixels, source->w, source->h, exact_palette, colour_palette_no, &exact_options, pool);
+			double exact_time = (double)(SDL_GetPerformanceCounter()-start_time)/SDL_GetPerformanceFrequency();
+			InverseColourMap *exactmap = BuildInverseColourMap(exact_palette, colour_palette_no);
+			
+			char made_from[64];
+			if (options->palette_samples > 0)
+			{
+				snprintf(made_from, sizeof(made_from), "%d samples", options->palette_samples);
+			}
+			else
+			{
+				snprintf(made_from, sizeof(made_from), "every pixel");
+			}
+			
+			printf("%d colour palette from %s%s: error %.2f, made in %.3f s\n", colour_palette_no, made_from,
+				(options->kmeans_iterations > 0) ? " with k-means" : "", PaletteError(source->pixels, (Sint64)source->w*source->h, colour_palette, colourmap), build_time);
+			printf("%d colour palette from every pixel (exact): error %.2f, made in %.3f s\n", colour_palette_no,
+				PaletteError(source->pixels, (Sint64)source->w*source->h, exact_palette, exactmap), exact_time);
+			FreeInverseColourMap(exactmap);
+		}
+		
+		//Keep the new colour palette and how well it fits its own image for the next image
+		if (options->palette_reuse >= 0)
+		{
+			cache->valid = 1;
+			cache->colour_palette_no = colour_palette_no;
+			memcpy(cache->colour_palette, colour_palette, colour_palette_no*sizeof(colour_palette[0]));
+			cache->error = SourcePaletteError(source, colour_palette, colourmap);
+		}
+	}
+	
+	//The surfaces are ARGB8888, so the pixel of a colour is its packed RGB value with an opaque alpha
+	for (int z=0; z<colour_palette_no; z++)
+	{
+		Palette_Colours[z] = 0xFF000000u | PACK_RGB(colour_palette[z][0],colour_palette[z][1],colour_palette[z][2]);
+	}
+	
+	return colourmap;
+}
+
+//Create a function to give every pixel of some rows the palette index of its closest colour
+void MapColourPalette(const InverseColourMap *colourmap, Uint32 colour_palette[][3], const Uint32 *Quantized_Pixels, Uint8 *Palette_Index, int w, int h, ThreadPool *pool)
+{
+	/*Parameters are...
+	const InverseColourMap *colourmap:	The inverse colour map of the colour palette.
+	Uint32 colour_palette[][3]:	The reduced colour palette.
+	const Uint32 *Quantized_Pixels:	The pixels of the rows.
+	Uint8 *Palette_Index:	The array which will store the palette index of every pixel of the rows.
+	int w:	The width of the rows.
+	int h:	The number of rows.
+	ThreadPool *pool:	The thread pool to share the rows with.
+	
+	The inverse colour map is built once for the palette, then each pixel only needs a table lookup to find its closest colour.
+	The rows are shared out between the threads in bands, every pixel only reading the inverse colour map.*/
+	
+	PaletteBands mapping = {colourmap, colour_palette, Quantized_Pixels, Palette_Index, w};
+	ShareBands(pool, BandCount(pool, h, (Sint64)w*h), h, MapPaletteBand, &mapping);
+}
+
+void ColourQuantization(int w,int h, Uint32 * Quantized_Pixels, Uint8 *Palette_Index, Uint32 *Palette_Colours, int colour_palette_no,
+	const BenDayOptions *options, ThreadPool *pool, PaletteCache *cache)
+{
+	/*Parameters are...
+	int w:	The width of the image.
+	int h:	The height of the image.
+	Uint32 * Quantized_Pixels:	The pixels to be quantized. They are not changed.
+	Uint8 *Palette_Index:	The array which will store the palette index of every pixel.
+	Uint32 *Palette_Colours:	The array which will store the pixels of the colours of the palette.
+	int colour_palette_no:	The number of colours that will result after the colour quantization. It can be at most 256.
+	const BenDayOptions *options:	The program options, which choose the quantization mode and whether colour palettes are reused.
+	ThreadPool *pool:	The thread pool to share the work with.
+	PaletteCache *cache:	The colour palette kept from the previous image for this call. It is updated when a new colour palette is made.*/
+	
+	//Create the array for the reduced colour palette
+	Uint32 colour_palette[256][3];
+	PaletteSource source;
+	memset(&source, 0, sizeof(PaletteSource));
+	source.pixels = Quantized_Pixels;
+	source.w = w;
+	source.h = h;
+	InverseColourMap *colourmap = ColourPalette(&source, colour_palette, Palette_Colours, colour_palette_no, options, pool, cache);
+	
+	//Assigning reduced colour_palette to image.
+	//Only the palette index of every pixel is kept, so BenDay can work on the colours of the palette instead of the pixels.
+	MapColourPalette(colourmap, colour_palette, Quantized_Pixels, Palette_Index, w, h, pool);
+	
+	FreeInverseColourMap(colourmap);
+}
+
+//What the bands of TwoToneGrayscale work on, and the counts and sums of every band
+typedef struct TwoToneBands
+{
+	const Uint32 *source;	//The pixels of the image
+	Uint32 *pixels;	//The pixels which will store the two tone grey image
+	int w;	//The width of the image
+	Sint64 (*count)[3][256];	//The counts of every channel, for every band
+	Uint64 (*total)[3][3];	//The sums of the colours below, at and above the median, for every band
+	Uint64 (*value_total)[3][256][3];	//The sums of the colours at every value of every channel, for every band
+	int longestColumn;	//The longest axis of the RGB
+	int median;	//The value of the longest axis which is shared out between the halves
+	int direction[3];	//Twice the colour of palette 0 minus the colour of palette 1
+	int limit;	//The projection below which a pixel is closer to palette 1
+	Uint32 tone[2];	//The grey of every colour palette
+} TwoToneBands;
+
+void CountToneBand(void *data, int band, int start, int end)
+{
+	TwoToneBands *tones = data;
+	Sint64 (*count)[256] = tones->count[band];
+	memset(count, 0, 3*256*sizeof(Sint64));
+	
+	for (Sint64 i=(Sint64)start*tones->w; i<(Sint64)end*tones->w; i++)
+	{
+		count[0][CHANNEL(tones->source[i],0)]++;
+		count[1][CHANNEL(tones->source[i],1)]++;
+		count[2][CHANNEL(tones->source[i],2)]++;
+	}
+}
+
+void SumToneBand(void *data, int band, int start, int end)
+{
+	TwoToneBands *tones = data;
+	Uint64 (*total)[3] = tones->total[band];
+	memset(total, 0, 3*3*sizeof(Uint64));
+	
+	for (Sint64 i=(Sint64)start*tones->w; i<(Sint64)end*tones->w; i++)
+	{
+		int value = CHANNEL(tones->source[i],tones->longestColumn);
+		Uint64 *sum = total[(value<tones->median) ? 0 : ((value>tones->median) ? 2 : 1)];
+		sum[0] += CHANNEL(tones->source[i],0);
+		sum[1] += CHANNEL(tones->source[i],1);
+		sum[2] += CHANNEL(tones->source[i],2);
+	}
+}
+
+void CountToneValuesBand(void *data, int band, int start, int end)
+{
+	TwoToneBands *tones = data;
+	Sint64 (*count)[256] = tones->count[band];
+	Uint64 (*total)[256][3] = tones->value_total[band];
+	memset(count, 0, 3*256*sizeof(Sint64));
+	memset(total, 0, 3*256*3*sizeof(Uint64));
+	
+	for (Sint64 i=(Sint64)start*tones->w; i<(Sint64)end*tones->w; i++)
+	{
+		int value[3] = {CHANNEL(tones->source[i],0), CHANNEL(tones->source[i],1), CHANNEL(tones->source[i],2)};
+		for (int column=0; column<3; column++)
+		{
+			count[column][value[column]]++;
+			total[column][value[column]][0] += value[0];
+			total[column][value[column]][1] += value[1];
+			total[column][value[column]][2] += value[2];
+		}
+	}
+}
+
+void MapToneBand(void *data, int band, int start, int end)
+{
+	TwoToneBands *tones = data;
+	
+	for (Sint64 i=(Sint64)start*tones->w; i<(Sint64)end*tones->w; i++)
+	{
+		int projection = CHANNEL(tones->source[i],0)*tones->direction[0] + CHANNEL(tones->source[i],1)*tones->direction[1] + CHANNEL(tones->source[i],2)*tones->direction[2];
+		tones->pixels[i] = tones->tone[(projection<tones->limit) ? 1 : 0];
+	}
+}
+
+//Create a function to find the longest axis of the RGB of an image and the value its two halves are split at
+void ToneMedian(Sint64 count[3][256], Sint64 size, TwoToneBands *tones, Sint64 *below)
+{
+	/*Parameters are...
+	Sint64 count[3][256]:	The counts of every channel of the image.
+	Sint64 size:	The number of pixels of the image.
+	TwoToneBands *tones:	The two tones, whose longest axis and median are set.
+	Sint64 *below:	The variable which will store the number of pixels with a value lower than the median.*/
+	
+	//Get the longest axis of the RGB
+	int range[3];
+	for (int column=0; column<3; column++)
+	{
+		int minimum = 0, maximum = 255;
+		while (minimum<255 && count[column][minimum] == 0) minimum++;
+		while (maximum>0 && count[column][maximum] == 0) maximum--;
+		range[column] = maximum-minimum;
+	}
+	int longestColumn = longest_axisRange(range[0], range[1], range[2]);
+	
+	//The first half gets the size/2 pixels with the lowest values, like the median cut.
+	//The pixels with the median value are shared out between the halves, each taking the average colour of that value.
+	Sint64 half = size/2;
+	int median = 0;
+	*below = 0;
+	while (median<255 && *below+count[longestColumn][median] <= half)
+	{
+		*below += count[longestColumn][median];
+		median++;
+	}
+	
+	tones->longestColumn = longestColumn;
+	tones->median = median;
+}
+
+//Create a function to work out the two tones of grey from the colours of the pixels below, at and above the median
+void SetTwoTones(TwoToneBands *tones, Sint64 median_count, Sint64 size, Sint64 below, Uint64 lower[3], Uint64 middle[3], Uint64 upper[3])
+{
+	/*Parameters are...
+	TwoToneBands *tones:	The two tones, from ToneMedian. Their tones and what MapToneBand needs to pick one are set.
+	Sint64 median_count:	The number of pixels with the median value.
+	Sint64 size:	The number of pixels of the image.
+	Sint64 below:	The number of pixels with a value lower than the median.
+	Uint64 lower[3]:	The sums of the colours of the pixels below the median. It becomes the sums of the first half.
+	Uint64 middle[3]:	The sums of the colours of the pixels with the median value.
+	Uint64 upper[3]:	The sums of the colours of the pixels above the median. It becomes the sums of the second half.*/
+	
+	Sint64 half = size/2;
+	if (median_count>0)
+	{
+		for (int column=0; column<3; column++)
+		{
+			//middle*(half-below) can pass 64 bits on large images, so split middle into whole multiples of the count and
+			//a remainder below it. This gives the same share, as both products then stay below count*size.
+			Uint64 shared_count = median_count;
+			Uint64 shared = middle[column]/shared_count*(half-below) + middle[column]%shared_count*(half-below)/shared_count;
+			lower[column] += shared;
+			upper[column] += middle[column]-shared;
+		}
+	}
+	
+	//The average colour of each half is its colour palette
+	int palette[2][3];
+	Sint64 halfsize[2] = {half, size-half};
+	for (int column=0; column<3; column++)
+	{
+		palette[0][column] = halfsize[0]>0 ? lower[column]/halfsize[0] : 0;
+		palette[1][column] = halfsize[1]>0 ? upper[column]/halfsize[1] : 0;
+	}
+	
+	//Give every pixel the grey of the closer colour palette
+	for (int i=0; i<2; i++)
+	{
+		Uint32 v = LUMA(PACK_RGB(palette[i][0], palette[i][1], palette[i][2]));
+		tones->tone[i] = (0xFF<<24) | (v<<16) | (v<<8) | v;
+	}
+	
+	//A pixel p is closer to palette 1 when |p-c1|^2 < |p-c0|^2, which is 2p.(c0-c1) < |c0|^2-|c1|^2
+	tones->limit = 0;
+	for (int column=0; column<3; column++)
+	{
+		tones->direction[column] = 2*(palette[0][column]-palette[1][column]);
+		tones->limit += palette[0][column]*palette[0][column] - palette[1][column]*palette[1][column];
+	}
+	
+	printf("colour palette of index 0 and 1 is generated for the edge detection\n");
+}
+
+//Create a function to work out the two tones of grey of an image for the edge detection
+void TwoTonePalette(int h, int w, const Uint32 *source, TwoToneBands *tones, ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The height of the image.
+	int w:	The width of the image.
+	const Uint32 *source:	The pixels of the image.
+	TwoToneBands *tones:	The two tones and what MapToneBand needs to give every pixel the closer one, to be filled in.
+				Its source and pixels are left for the caller to set.
+	ThreadPool *pool:	The thread pool to share the rows with.
+	
+	This does the same job as a colour palette of 2. The single cut of the median cut is made on the histograms of the channels
+	instead of the pixels, so nothing is copied or partitioned.
+	Both scans are shared out in bands of rows. The counts and sums of the bands are whole numbers, so adding them up gives the same
+	result for any number of bands.*/
+	
+	Sint64 size = (Sint64)w*h;
+	int bands = BandCount(pool, h, size);
+	memset(tones, 0, sizeof(TwoToneBands));
+	tones->source = source;
+	tones->w = w;
+	tones->count = malloc(bands*sizeof(*tones->count));
+	tones->total = malloc(bands*sizeof(*tones->total));
+	
+	if(tones->count == NULL || tones->total == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	//Count every channel
+	Sint64 count[3][256];
+	memset(count, 0, sizeof(count));
+	
+	ShareBands(pool, bands, h, CountToneBand, tones);
+	for (int band=0; band<bands; band++)
+	{
+		for (int column=0; column<3; column++)
+		{
+			for (int value=0; value<256; value++)
+			{
+				count[column][value] += tones->count[band][column][value];
+			}
+		}
+	}
+	
+	Sint64 below;
+	ToneMedian(count, size, tones, &below);
+	
+	//Add up the colours below, at and above the median in one more scan
+	ShareBands(pool, bands, h, SumToneBand, tones);
+	
+	Uint64 lower[3] = {0}, upper[3] = {0}, middle[3] = {0};
+	for (int band=0; band<bands; band++)
+	{
+		for (int column=0; column<3; column++)
+		{
+			lower[column] += tones->total[band][0][column];
+			middle[column] += tones->total[band][1][column];
+			upper[column] += tones->total[band][2][column];
+		}
+	}
+	
+	free(tones->total);
+	free(tones->count);
+	tones->total = NULL;
+	tones->count = NULL;
+	
+	SetTwoTones(tones, count[tones->longestColumn][tones->median], size, below, lower, middle, upper);
+}
+
+//Create a function to turn the image into two tones of grey for the edge detection
+void TwoToneGrayscale(int h, int w, const Uint32 *source, Uint32 *pixels, ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The height of the image.
+	int w:	The width of the image.
+	const Uint32 *source:	The pixels of the image.
+	Uint32 *pixels:	The pixels which will store the two tone grey image. They can be the same as the source.
+	ThreadPool *pool:	The thread pool to share the rows with.
+	
+	This does the same job as a colour palette of 2 followed by the grayscale conversion.*/
+	
+	TwoToneBands tones;
+	TwoTonePalette(h, w, source, &tones, pool);
+	tones.pixels = pixels;
+	ShareBands(pool, BandCount(pool, h, (Sint64)w*h), h, MapToneBand, &tones);
+}
+
+//Number of box blurs stacked to approximate a gaussian blur of any size
+#define BOX_PASSES 3
+
+//Create a function to work out the radii of the box blurs which together blur like a gaussian
+void BoxRadii(double sigma, int radius[BOX_PASSES])
+{
+	/*Parameters are...
+	double sigma:	The standard deviation of the gaussian blur.
+	int radius[BOX_PASSES]:	The array which will store the radius of every box blur, the smaller ones first.
+	
+	Box widths are odd, so they stay centred on the pixel. The ideal width is rounded down to an odd number and some of the boxes are made
+	two pixels wider, however many brings the variance of the stacked boxes closest to sigma squared.*/
+	
+	double variance = sigma*sigma;
+	int narrow = (int)floor(sqrt(12*variance/BOX_PASSES + 1));
+	if (narrow%2 == 0) narrow--;
+	int narrow_count = (int)floor((12*variance - BOX_PASSES*narrow*narrow - 4*BOX_PASSES*narrow - 3*BOX_PASSES) / (-4.0*narrow - 4) + 0.5);
+	
+	for (int i=0; i<BOX_PASSES; i++)
+	{
+		radius[i] = (i<narrow_count) ? narrow/2 : narrow/2 + 1;
+	}
+}
+
+//Create a function to work out how many pixels the stacked box blurs of a gaussian blur reach either side of a pixel
+int BoxReach(double sigma)
+{
+	/*Parameters are...
+	double sigma:	The standard deviation of the gaussian blur.
+	Returns the radii of the box blurs added up.*/
+	
+	int radius[BOX_PASSES];
+	BoxRadii(sigma, radius);
+	
+	int reach = 0;
+	for (int pass=0; pass<BOX_PASSES; pass++)
+	{
+		reach += radius[pass];
+	}
+	return reach;
+}
+
+//Create a function to box blur a row, with the cost of a pixel the same for every radius
+void BoxBlurRow(const Uint16 *padded, Uint16 *out, int w, int radius, int *sums)
+{
+	/*Parameters are...
+	const Uint16 *padded:	The values of the row with at least radius+1 repeated values on either side. padded[0] is the first pixel.
+	Uint16 *out:	The array which will store the blured row.
+	int w:	The width of the row.
+	int radius:	The radius of the box. The box is 2*radius+1 pixels wide.
+	int *sums:	A buffer of w values for the sums of the boxes.
+	
+	A running sum slides along the row, adding the pixel entering the box and taking away the pixel leaving it.
+	The division by the width of the box is a multiplication by its reciprocal, rounded to the closest value,
+	which is exact where the row is flat. It is a loop of its own so it can be vectorised.*/
+	
+	float reciprocal = 1.0f/(2*radius + 1);
+	int sum = 0;
+	
+	for (int k=-radius; k<=radius; k++)
+	{
+		sum += padded[k];
+	}
+	
+	for (int x=0; x<w; x++)
+	{
+		sums[x] = sum;
+		sum += padded[x+radius+1] - padded[x-radius];
+	}
+	
+	for (int x=0; x<w; x++)
+	{
+		out[x] = (Uint16)(sums[x]*reciprocal + 0.5f);
+	}
+}
+
+//Create a function to box blur every column of an image in place, with the cost of a pixel the same for every radius
+void BoxBlurColumns(Uint16 *plane, int h, int w, int stride, int radius, Uint16 *saved, int *sums)
+{
+	/*Parameters are...
+	Uint16 *plane:	The values of the image. They are replaced with the blured values.
+	int h:	The height of the image.
+	int w:	The number of columns to blur.
+	int stride:	The number of values from one row of the plane to the next.
+	int radius:	The radius of the box. The box is 2*radius+1 pixels high.
+	Uint16 *saved:	A buffer of (radius+1)*w values to keep the rows which have been blured but are still in the box.
+	int *sums:	A buffer of w values for the running sums.
+	
+	A row of running sums slides down the image, one sum for every column, so the work is done a whole row at a time
+	and the compiler can vectorise it. Rows past the top and bottom of the image take the value of the closest row inside it.*/
+	
+	float reciprocal = 1.0f/(2*radius + 1);
+	
+	for (int x=0; x<w; x++)
+	{
+		sums[x] = 0;
+	}
+	for (int k=-radius; k<=radius; k++)
+	{
+		const Uint16 *row = plane + (Sint64)((k<0) ? 0 : (k>h-1) ? h-1 : k)*stride;
+		for (int x=0; x<w; x++)
+		{
+			sums[x] += row[x];
+		}
+	}
+	
+	for (int y=0; y<h; y++)
+	{
+		Uint16 *row = plane + (Sint64)y*stride;
+		
+		//Keep the row before it is blured, the sums still need it for the next radius rows
+		memcpy(saved + (y%(radius+1))*w, row, w*sizeof(Uint16));
+		for (int x=0; x<w; x++)
+		{
+			row[x] = (Uint16)(sums[x]*reciprocal + 0.5f);
+		}
+		
+		if (y<h-1)
+		{
+			const Uint16 *entering = plane + (Sint64)((y+radius+1>h-1) ? h-1 : y+radius+1)*stride;
+			const Uint16 *leaving = saved + (((y-radius<0) ? 0 : y-radius)%(radius+1))*w;
+			for (int x=0; x<w; x++)
+			{
+				sums[x] += entering[x] - leaving[x];
+			}
+		}
+	}
+}
+
+//What the bands of the edge detection work on
+typedef struct EdgeBands
+{
+	const Uint32 *grey;	//The grey pixels to find the edges of
+	Uint32 *pixels;	//The pixels which will store the edge detection
+	Uint16 *plane;	//The blured image of GaussianBoxBlur
+	const Uint16 *light;	//The light blur of ScaledEdgeDetection
+	const Uint16 *heavy;	//The heavy blur of ScaledEdgeDetection
+	int h;	//The height of the image
+	int w;	//The width of the image
+	int radius[BOX_PASSES];	//The radius of every box blur of GaussianBoxBlur
+} EdgeBands;
+
+void BlurRowsBand(void *data, int band, int start, int end)
+{
+	EdgeBands *edge = data;
+	int w = edge->w;
+	int widest = edge->radius[BOX_PASSES-1];
+	
+	Uint16 *lines = malloc(2*(w + 2*widest + 2)*sizeof(Uint16));	//Two rows with their border pixels repeated widest+1 times on either side
+	int *sums = malloc(w*sizeof(int));
+	
+	if(lines == NULL || sums == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	Uint16 *padded[2] = {lines + widest + 1, lines + (w + 2*widest + 2) + widest + 1};
+	
+	//The passes go back and forth between the two padded rows and the last one writes straight into the plane
+	for (int y=start; y<end; y++)
+	{
+		Uint16 *row = edge->plane + (Sint64)y*w;
+		for (int x=0; x<w; x++)
+		{
+			padded[0][x] = (edge->grey[(Sint64)y*w + x] & 0xFF) << 8;
+		}
+		
+		for (int pass=0; pass<BOX_PASSES; pass++)
+		{
+			Uint16 *in = padded[pass%2];
+			for (int k=1; k<=widest+1; k++)
+			{
+				in[-k] = in[0];
+				in[w-1+k] = in[w-1];
+			}
+			BoxBlurRow(in, (pass<BOX_PASSES-1) ? padded[(pass+1)%2] : row, w, edge->radius[pass], sums);
+		}
+	}
+	
+	free(sums);
+	free(lines);
+}
+
+void BlurColumnsBand(void *data, int band, int start, int end)
+{
+	EdgeBands *edge = data;
+	int columns = end-start;
+	
+	Uint16 *saved = malloc((Sint64)(edge->radius[BOX_PASSES-1]+1)*columns*sizeof(Uint16));
+	int *sums = malloc(columns*sizeof(int));
+	
+	if(saved == NULL || sums == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	for (int pass=0; pass<BOX_PASSES; pass++)
+	{
+		BoxBlurColumns(edge->plane+start, edge->h, columns, edge->w, edge->radius[pass], saved, sums);
+	}
+	
+	free(sums);
+	free(saved);
+}
+
+//Create a function to blur the grey pixels with stacked box blurs, which come close to a gaussian blur
+void GaussianBoxBlur(int h, int w, const Uint32 *pixels, double sigma, Uint16 *plane, ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The height of the image.
+	int w:	The width of the image.
+	const Uint32 *pixels:	The grey pixels of the image. The blue channel is used as the grey value.
+	double sigma:	The standard deviation of the gaussian blur in pixels.
+	Uint16 *plane:	The array which will store the blured image, as grey values with 8 bits after the point.
+	ThreadPool *pool:	The thread pool to share the work with.
+	
+	The rows are blured in bands of rows and then the columns in stripes of columns, as every row and every column is blured on its own.*/
+	
+	EdgeBands edge;
+	memset(&edge, 0, sizeof(edge));
+	edge.grey = pixels;
+	edge.plane = plane;
+	edge.h = h;
+	edge.w = w;
+	BoxRadii(sigma, edge.radius);
+	
+	//Blur the rows, keeping 8 bits after the point so the stacked blurs do not lose the small differences the edge detection looks for
+	ShareBands(pool, BandCount(pool, h, (Sint64)w*h), h, BlurRowsBand, &edge);
+	
+	//Then blur the columns
+	ShareBands(pool, BandCount(pool, w, (Sint64)w*h), w, BlurColumnsBand, &edge);
+}
+
+void ScaledEdgeBand(void *data, int band, int start, int end)
+{
+	EdgeBands *edge = data;
+	int h = edge->h;
+	int w = edge->w;
+	
+	Sint8 *signrows = malloc(3*w);	//The sign of the heavy blur minus the light blur, at the row number modulo 3
+	
+	if(signrows == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	for (int y=start; y<end; y++)
+	{
+		//Work out the signs of the row below, or of the rows above, at and below the first row of the band
+		for (int s=(y>start) ? y+1 : (y>0) ? y-1 : 0; s<=y+1 && s<h; s++)
+		{
+			const Uint16 *lightrow = edge->light + (Sint64)s*w;
+			const Uint16 *heavyrow = edge->heavy + (Sint64)s*w;
+			Sint8 *sign = signrows + (s%3)*w;
+			for (int x=0; x<w; x++)
+			{
+				int lightvalue = (lightrow[x] + 128) >> 8;
+				int heavyvalue = (heavyrow[x] + 128) >> 8;
+				sign[x] = (heavyvalue>lightvalue) - (heavyvalue<lightvalue);
+			}
+		}
+		
+		//Mark the pixels on the positive side of a change of sign
+		const Sint8 *row = signrows+(y%3)*w;
+		const Sint8 *up = (y>0) ? signrows+((y-1)%3)*w : row;
+		const Sint8 *down = (y<h-1) ? signrows+((y+1)%3)*w : row;
+		Kernels.mark_edge_row(up, row, down, edge->pixels+(Sint64)y*w, w);
+	}
+	
+	free(signrows);
+}
+
+//Create a function to find the edges with a difference of gaussians of any size
+void ScaledEdgeDetection(int h, int w, const Uint32 *grey, Uint32 *pixels, double light_sigma, double heavy_sigma, ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The height of the image.
+	int w:	The width of the image.
+	const Uint32 *grey:	The grey pixels to find the edges of.
+	Uint32 *pixels:	The pixels which will store the edge detection, black on the edges and white elsewhere.
+	double light_sigma:	The standard deviation of the light blur in pixels.
+	double heavy_sigma:	The standard deviation of the heavy blur in pixels.
+	ThreadPool *pool:	The thread pool to share the work with.
+	
+	The blurs are stacked box blurs, so they take the same time for any sigma. Both blurs are rounded to 8 bits before they are compared,
+	as in EdgeDetection, and the edges are marked the same way. The blurs are finished before the edges are marked,
+	so every band of rows works out the signs of the row above and below it again from them.*/
+	
+	Uint16 *light = malloc((Sint64)h*w*sizeof(Uint16));
+	Uint16 *heavy = malloc((Sint64)h*w*sizeof(Uint16));
+	
+	if(light == NULL || heavy == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	GaussianBoxBlur(h, w, grey, light_sigma, light, pool);
+	GaussianBoxBlur(h, w, grey, heavy_sigma, heavy, pool);
+	
+	EdgeBands edge;
+	memset(&edge, 0, sizeof(edge));
+	edge.pixels = pixels;
+	edge.light = light;
+	edge.heavy = heavy;
+	edge.h = h;
+	edge.w = w;
+	ShareBands(pool, BandCount(pool, h, (Sint64)w*h), h, ScaledEdgeBand, &edge);
+	
+	free(heavy);
+	free(light);
+}
+
+//Number of rows kept by the rolling buffers of the edge detection. It has to be a power of 2 and hold the 6 rows in use.
+#define EDGE_ROWS 8
+
+void EdgeDetectionBand(void *data, int band, int start, int end)
+{
+	EdgeBands *edge = data;
+	int h = edge->h;
+	int w = edge->w;
+	
+	Uint8 *padded = malloc(w+4);
+	Uint16 *lightrows = malloc(EDGE_ROWS*w*sizeof(Uint16));	//Rows blured with 1-2-1, at the row number modulo EDGE_ROWS
+	Uint16 *heavyrows = malloc(EDGE_ROWS*w*sizeof(Uint16));	//Rows blured with 1-4-6-4-1, at the row number modulo EDGE_ROWS
+	Sint8 *signrows = malloc(4*w);	//The sign of the heavy blur minus the light blur, at the row number modulo 4
+	
+	if(padded == NULL || lightrows == NULL || heavyrows == NULL || signrows == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	//The band starts with the signs of the row above it, which need the blured rows up to two further up
+	int signed_rows = (start>0) ? start-1 : 0;	//The number of rows of signs worked out so far
+	int blured = (signed_rows>2) ? signed_rows-2 : 0;	//The number of rows blured so far
+	
+	for (int y=start; y<end; y++)
+	{
+		//Work out the signs of the rows up to the one below this row, which needs the blured rows up to two further down
+		int last_sign = (y+1<h) ? y+1 : h-1;
+		for (; signed_rows<=last_sign; signed_rows++)
+		{
+			int s = signed_rows;
+			int last_blur = (s+2<h) ? s+2 : h-1;
+			for (; blured<=last_blur; blured++)
+			{
+				//The row is copied as 8 bit grey values with its border pixels repeated, so the kernels never have to check the border
+				Kernels.grey_row(edge->grey+(Sint64)blured*w, padded+2, w);
+				padded[0] = padded[1] = padded[2];
+				padded[w+3] = padded[w+2] = padded[w+1];
+				Kernels.blur_row(padded, lightrows+(blured%EDGE_ROWS)*w, heavyrows+(blured%EDGE_ROWS)*w, w);
+			}
+			
+			//Rows beyond the border of the image take the value of the closest row inside it
+			const Uint16 *light[3], *heavy[5];
+			for (int k=-2; k<=2; k++)
+			{
+				int row = s+k;
+				if (row<0) row = 0;
+				if (row>h-1) row = h-1;
+				heavy[k+2] = heavyrows+(row%EDGE_ROWS)*w;
+				if (k>=-1 && k<=1) light[k+1] = lightrows+(row%EDGE_ROWS)*w;
+			}
+			
+			/////////////////////////////////////////////////////////////////////////////////////////////////
+			//Light and heavy convolution blurring of the columns, then subtract weaker gaussian from stronger gaussian
+			Kernels.sign_row(light, heavy, signrows+(s%4)*w, w);
+		}
+		
+		//Mark the pixels on the positive side of a change of sign
+		const Sint8 *row = signrows+(y%4)*w;
+		const Sint8 *up = (y>0) ? signrows+((y-1)%4)*w : row;
+		const Sint8 *down = (y<h-1) ? signrows+((y+1)%4)*w : row;
+		Kernels.mark_edge_row(up, row, down, edge->pixels+(Sint64)y*w, w);
+	}
+	
+	free(signrows);
+	free(heavyrows);
+	free(lightrows);
+	free(padded);
+}
+
+void EdgeDetection(int h, int w, const Uint32 *grey, Uint32 *pixels, const double edge_sigma[2], ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The height of the image.
+	int w:	The width of the image.
+	const Uint32 *grey:	The grey pixels to find the edges of.
+	Uint32 *pixels:	The pixels which will store the edge detection, black on the edges and white elsewhere.
+	const double edge_sigma[2]:	The standard deviations of the light and heavy blurs. If they are 0 the fixed kernels below are used.
+	ThreadPool *pool:	The thread pool to share the bands of rows with.
+	
+	The light blur is the 3x3 kernel 1-2-1 and the heavy blur the 5x5 kernel 1-4-6-4-1, each done as a blur of the rows
+	followed by a blur of the columns with a single rounding at the end. The edges are where the heavy blur minus the light blur changes sign.
+	
+	Every band of rows is done in one pass down the band. Only the last few blured rows and rows of signs are kept, so they stay in the cache.
+	A row of signs needs the blured rows two above and below it, and a marked row the signs of the rows above and below it,
+	so a band blurs the three rows above it and below it again rather than waiting for its neighbours. The grey pixels are kept apart
+	from the edge detection, so a band never reads a row that another band has already marked.*/
+	
+	if (edge_sigma[0] > 0)
+	{
+		ScaledEdgeDetection(h, w, grey, pixels, edge_sigma[0], edge_sigma[1], pool);
+		return;
+	}
+	
+	EdgeBands edge;
+	memset(&edge, 0, sizeof(edge));
+	edge.grey = grey;
+	edge.pixels = pixels;
+	edge.h = h;
+	edge.w = w;
+	ShareBands(pool, BandCount(pool, h, (Sint64)w*h), h, EdgeDetectionBand, &edge);
+}
+
+void CombineReplace(const Uint64 *edges, Uint32 *out, int words)
+{
+	/*Parameters are...
+	const Uint64 *edges:	The bits of the row of the thickened edges.
+	Uint32 *out:	The pixels of the row which are colour quantized and/or have the benday implemented.
+	int words:	The number of words in the row of bits.
+	
+	Only the set bits are visited, so rows with few edges are quick.*/
+	
+	//The thickened edges replace the pixels under them with black, and every other pixel is left as it is
+	for (int i=0; i<words; i++)
+	{
+		Uint64 word = edges[i];
+		while (word)
+		{
+			out[64*i + __builtin_ctzll(word)] = BENDAY_BLACK;
+			word &= word-1;
+		}
+	}
+}
+
+void CombineMultiply(const Uint32 *line, const Uint64 *edges, Uint32 *out, int w)
+{
+	/*Parameters are...
+	const Uint32 *line:	The pixels of the row of the soft edges, from SoftEdges.
+	const Uint64 *edges:	The bits of the row of the thickened edges.
+	Uint32 *out:	The pixels of the row which are colour quantized and/or have the benday implemented.
+	int w:	The width of the row.
+	
+	The thickened edges are black, and black multiplied with any pixel of the image is black, so they are drawn over the product
+	instead of being added to the soft edges first.*/
+	
+	//Every pixel is multiplied with the soft edges, each channel as a fraction of 255, so the image darkens smoothly towards the edges.
+	//Then the thickened edges are drawn in black over it, as with CombineReplace.
+	Kernels.multiply_row(line, out, w);
+	CombineReplace(edges, out, (w+63)/64);
+}
+
+//The Ben Day colours of a colour palette
+typedef struct PaletteClasses
+{
+	Uint32 colour[256*4];	//For every palette colour, its Ben Day colour on a white, a coloured and any other template pixel, and a spare to make 4
+	Uint8 darkness[256];	//How dark every palette colour is, 255 less its luma, for the size of the dots of the built in screen
+	Uint8 dark[256];	//Set where the red, green and blue of the palette colour add up to less than 200
+} PaletteClasses;
+
+//Create a function to work out the Ben Day colours of every colour of the palette
+void ClassifyPalette(const Uint32 *Palette_Colours, int colour_palette_no, PaletteClasses *classes)
+{
+	/*Parameters are...
+	const Uint32 *Palette_Colours:	The pixels of the colours of the palette.
+	int colour_palette_no:	The number of colours in the palette.
+	PaletteClasses *classes:	The Ben Day colours to be filled in.
+	
+	Colours close to red/blue/yellow/black/white are turned into those colours, the later ones winning, whatever the template.
+	The other colours are turned white where the template is white for light colours, or where the template is not white for dark colours.*/
+	
+	for (int i=0; i<colour_palette_no; i++)
+	{
+		Uint32 pixel = Palette_Colours[i];
+		int r1 = CHANNEL(pixel,0);
+		int g1 = CHANNEL(pixel,1);
+		int b1 = CHANNEL(pixel,2);
+		int matched = 0;
+		
+		if (r1>150 && g1<50 && b1<50) {pixel = BENDAY_RED; matched = 1;}
+		if (r1<125 && g1<125 && b1>150) {pixel = BENDAY_BLUE; matched = 1;}
+		if (r1>220 && g1>170 && b1<130) {pixel = BENDAY_YELLOW; matched = 1;}
+		if (r1<100 && g1<100 && b1<100) {pixel = BENDAY_BLACK; matched = 1;}
+		if (r1>200 && g1>200 && b1>200) {pixel = BENDAY_WHITE; matched = 1;}
+		
+		int dark = (r1 + g1 + b1)<200;
+		classes->colour[4*i] = (!matched && !dark) ? BENDAY_WHITE : pixel;
+		classes->colour[4*i+1] = (!matched && dark) ? BENDAY_WHITE : pixel;
+		classes->colour[4*i+2] = pixel;
+		classes->colour[4*i+3] = pixel;
+		classes->darkness[i] = 255 - LUMA(Palette_Colours[i]);
+		classes->dark[i] = dark;
+	}
+}
+
+//What the bands of BenDay work on
+typedef struct BenDayBands
+{
+	Uint32 * Quantized_Pixels;	//The pixels which will store the finished image
+	const Uint8 *Palette_Index;	//The palette index of every pixel
+	const PaletteClasses *classes;	//The Ben Day colours of the palette
+	const Uint32 * BenDay_Pixels;	//The pixels of the Ben Day Dots template, or NULL to use the dot screen
+	int tw;	//The width of the template
+	int th;	//The height of the template
+	const HalftoneScreen *screen;	//The built in dot screen
+	const Uint32 *pixels;	//The pixels which contains the soft edges, for BLEND_MULTIPLY
+	const Uint64 *edges;	//The thickened edges
+	int blend;	//How the edges are combined with the image
+	int w;	//The width of the image
+	int first;	//The row of the image the rows start at
+} BenDayBands;
+
+void BenDayBand(void *data, int band, int start, int end)
+{
+	BenDayBands *benday = data;
+	const PaletteClasses *classes = benday->classes;
+	const Uint32 *BenDay_Pixels = benday->BenDay_Pixels;
+	int w = benday->w;
+	int tw = benday->tw;
+	int th = benday->th;
+	
+	Uint32 *dots = NULL;	//A row of the dot screen or of the repeated template
+	if (BenDay_Pixels == NULL || tw != w)
+	{
+		dots = malloc(w*sizeof(Uint32));
+		if(dots == NULL)
+		{
+			printf("Insufficient memory\n");
+			exit(1);
+		}
+	}
+	
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//Convert colours close to red/blue/yellow/black and white to respective colours,
+	//and the others to ben day templates, in one pass with the kernels picked for the CPU
+	int words = (w+63)/64;
+	for (int y=start; y<end; y++)
+	{
+		const Uint8 *index = benday->Palette_Index+(Sint64)y*w;
+		Uint32 *out = benday->Quantized_Pixels+(Sint64)y*w;
+		if (BenDay_Pixels == NULL)
+		{
+			HalftoneRow(benday->screen, benday->first+y, index, classes->darkness, classes->dark, dots, w);
+			Kernels.benday_row(index, dots, classes->colour, out, w);
+		}
+		else if (dots != NULL)
+		{
+			//Wrap round the template, copying as much of its row as fits each time
+			const Uint32 *row = BenDay_Pixels+(Sint64)((benday->first+y)%th)*tw;
+			for (int x=0; x<w; x+=tw)
+			{
+				memcpy(dots+x, row, ((w-x < tw) ? w-x : tw)*sizeof(Uint32));
+			}
+			Kernels.benday_row(index, dots, classes->colour, out, w);
+		}
+		else
+		{
+			Kernels.benday_row(index, BenDay_Pixels+(Sint64)((benday->first+y)%th)*w, classes->colour, out, w);
+		}
+		
+		//Combining edges from edge detection to the row
+		if (benday->blend == BLEND_MULTIPLY)
+		{
+			CombineMultiply(benday->pixels+(Sint64)y*w, benday->edges+(Sint64)y*words, out, w);
+		}
+		else
+		{
+			CombineReplace(benday->edges+(Sint64)y*words, out, words);
+		}
+	}
+	free(dots);
+}
+
+void BenDay(int h, int w, Uint32 * Quantized_Pixels, const Uint8 *Palette_Index, const Uint32 *Palette_Colours, int colour_palette_no,
+	const Uint32 * BenDay_Pixels, int tw, int th, const HalftoneScreen *screen, const Uint32 *pixels, const Uint64 *edges, int blend, int first, ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The number of rows to work on.
+	int w:	The width of the image.
+	Uint32 * Quantized_Pixels:	The pixels which will store the finished image
+	const Uint8 *Palette_Index:	The palette index of every pixel, from the colour quantization
+	const Uint32 *Palette_Colours:	The pixels of the colours of the palette
+	int colour_palette_no:	The number of colours in the palette
+	const Uint32 * BenDay_Pixels:	The pixels of the Ben Day Dots template, or NULL to use the dot screen
+	int tw:	The width of the template. If it is not the width of the image the template is repeated across it.
+	int th:	The height of the template. Its rows are repeated down the image from row 0.
+	const HalftoneScreen *screen:	The built in dot screen, used when there is no template.
+	const Uint32 *pixels:	The pixels which contains the soft edges from SoftEdges. They are only read for BLEND_MULTIPLY.
+	const Uint64 *edges:	The thickened edges from ThickenEdges, one bit for every pixel.
+	int blend:	How the edges are combined with the image, BLEND_REPLACE or BLEND_MULTIPLY.
+	int first:	The row of the image the rows start at, which picks the rows of the dot screen and the template.
+			The other arrays start at that row, so the image can be done a strip of rows at a time.
+	ThreadPool *pool:	The thread pool to share the bands of rows with.
+	
+	The colours are only worked out once for every colour of the palette, so each pixel is a lookup of its palette index and its kind of template pixel.
+	The edges are combined with each row while it is still in the cache, so every pixel of the finished image is only written once.
+	Every row only depends on its own row of the index, the template or screen and the edges, so the bands of rows need no rows of each other.*/
+	
+	PaletteClasses classes;
+	ClassifyPalette(Palette_Colours, colour_palette_no, &classes);
+	
+	BenDayBands benday = {Quantized_Pixels, Palette_Index, &classes, BenDay_Pixels, tw, th, screen, pixels, edges, blend, w, first};
+	ShareBands(pool, BandCount(pool, h, (Sint64)w*h), h, BenDayBand, &benday);
+}
+
+//Create a function to spread the bits of a row one pixel to the left and right
+void DilateEdgeRow(const Uint64 *bits, Uint64 *out, int words)
+{
+	/*Parameters are...
+	const Uint64 *bits:	The packed bits of the row.
+	Uint64 *out:	The array which will store the spread bits.
+	int words:	The number of words in the row.
+	
+	Every shift moves 64 pixels at once. The bit which crosses into the next or previous word is carried over from that word.*/
+	
+	for (int i=0; i<words; i++)
+	{
+		Uint64 previous = (i>0) ? bits[i-1] : 0;
+		Uint64 next = (i<words-1) ? bits[i+1] : 0;
+		out[i] = bits[i] | (bits[i]<<1) | (previous>>63) | (bits[i]>>1) | (next<<63);
+	}
+}
+
+//What the bands of StrokeEdges and ThickenEdges work on
+typedef struct ThickenBands
+{
+	const Uint32 *pixels;	//The pixels which contains the edge detection
+	Uint64 *edges;	//The array which will store the thickened edges
+	Uint16 *column;	//The distance of every pixel to the closest edge pixel in its column, for StrokeEdges
+	int h;	//The height of the image
+	int w;	//The width of the image
+	int cap;	//Any column distance from here up is too far for the pixel to be in a stroke
+	Sint64 limit;	//Black where 4 times the squared distance is below this
+} ThickenBands;
+
+void StrokeColumnsBand(void *data, int band, int start, int end)
+{
+	ThickenBands *thicken = data;
+	int h = thicken->h;
+	int w = thicken->w;
+	int cap = thicken->cap;
+	
+	//Distance to the closest edge pixel in the same column, down the image then back up it, a row of the stripe at a time
+	for (int y=0; y<h; y++)
+	{
+		const Uint32 *line = thicken->pixels+(Sint64)y*w;
+		const Uint16 *above = thicken->column+(Sint64)(y-1)*w;
+		Uint16 *row = thicken->column+(Sint64)y*w;
+		for (int x=start; x<end; x++)
+		{
+			int distance = (y>0 && above[x]<cap) ? above[x]+1 : cap;
+			row[x] = ((line[x] & 0xFFFFFF) == 0) ? 0 : distance;
+		}
+	}
+	for (int y=h-2; y>=0; y--)
+	{
+		const Uint16 *below = thicken->column+(Sint64)(y+1)*w;
+		Uint16 *row = thicken->column+(Sint64)y*w;
+		for (int x=start; x<end; x++)
+		{
+			if (below[x]+1 < row[x]) row[x] = below[x]+1;
+		}
+	}
+}
+
+void StrokeRowsBand(void *data, int band, int first, int end)
+{
+	ThickenBands *thicken = data;
+	int w = thicken->w;
+	int cap = thicken->cap;
+	int words = (w+63)/64;
+	memset(thicken->edges+(Sint64)first*words, 0, (Sint64)(end-first)*words*sizeof(Uint64));
+	
+	int *site = malloc(w*sizeof(int));	//The columns whose parabolas make up the lower envelope
+	int *start = malloc(w*sizeof(int));	//The first pixel where each of them is the lowest
+	
+	if(site == NULL || start == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	//Distance along the rows, from the lower envelope of the parabolas of the column distances
+	#define PARABOLA(x,i) ((Sint64)((x)-(i))*((x)-(i)) + (Sint64)g[i]*g[i])
+	for (int y=first; y<end; y++)
+	{
+		const Uint16 *g = thicken->column+(Sint64)y*w;
+		Uint64 *line = thicken->edges+(Sint64)y*words;
+		
+		//A row with no edge pixel close enough has nothing to draw
+		int near = 0;
+		for (int x=0; x<w; x++)
+		{
+			near |= (g[x]<cap);
+		}
+		if (!near)
+		{
+			continue;
+		}
+		
+		int q = 0;
+		site[0] = 0;
+		start[0] = 0;
+		for (int u=1; u<w; u++)
+		{
+			while (q>=0 && PARABOLA(start[q], site[q]) > PARABOLA(start[q], u))
+			{
+				q--;
+			}
+			
+			if (q<0)
+			{
+				q = 0;
+				site[0] = u;
+			}
+			else
+			{
+				//The first pixel where u is lower than the last parabola of the envelope
+				int i = site[q];
+				Sint64 crossing = 1 + ((Sint64)u*u - (Sint64)i*i + (Sint64)g[u]*g[u] - (Sint64)g[i]*g[i]) / (2*(u-i));
+				if (crossing < w)
+				{
+					q++;
+					site[q] = u;
+					start[q] = (int)crossing;
+				}
+			}
+		}
+		
+		for (int u=w-1; u>=0; u--)
+		{
+			if (4*PARABOLA(u, site[q]) < thicken->limit)
+			{
+				line[u/64] |= (Uint64)1 << (u%64);
+			}
+			if (u == start[q])
+			{
+				q--;
+			}
+		}
+	}
+	#undef PARABOLA
+	
+	free(start);
+	free(site);
+}
+
+//Create a function to draw the edges as strokes of any width with a distance transform
+void StrokeEdges(int h, int w, const Uint32 *pixels, int stroke_width, Uint64 *edges, ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The height of the image.
+	int w:	The width of the image.
+	const Uint32 *pixels:	The pixels which contains the edge detection.
+	int stroke_width:	The width of the strokes in pixels.
+	Uint64 *edges:	The array which will store the stroked edges, one bit for every pixel and (w+63)/64 words to a row.
+	ThreadPool *pool:	The thread pool to share the work with.
+	
+	A pixel is made black when its distance from the closest edge pixel is less than half the stroke width, so the strokes are round.
+	The distances come from a Euclidean distance transform done in two passes, each taking the same time for any width.
+	The first pass finds the distance to the closest edge pixel up or down each column. The second goes along each row and
+	keeps the lower envelope of the parabolas (x-i)^2 + column distance at i, from which the distance to every pixel is read off.
+	The first pass is shared out in stripes of columns and the second in bands of rows.
+	
+	Column distances only need to be known up to half the stroke width, so they are capped just above it and kept in 16 bits.*/
+	
+	ThickenBands thicken = {pixels, edges, NULL, h, w, stroke_width/2 + 1, (Sint64)stroke_width*stroke_width};
+	thicken.column = malloc((Sint64)h*w*sizeof(Uint16));
+	
+	if(thicken.column == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	ShareBands(pool, BandCount(pool, w, (Sint64)w*h), w, StrokeColumnsBand, &thicken);
+	ShareBands(pool, BandCount(pool, h, (Sint64)w*h), h, StrokeRowsBand, &thicken);
+	
+	free(thicken.column);
+}
+
+void ThickenBand(void *data, int band, int start, int end)
+{
+	ThickenBands *thicken = data;
+	int h = thicken->h;
+	int w = thicken->w;
+	int words = (w+63)/64;
+	
+	Uint64 *packed = malloc(words*sizeof(Uint64));
+	Uint64 *raw = malloc(3*words*sizeof(Uint64));	//Rows of packed bits, at the row number modulo 3
+	Uint64 *dilated = calloc(3*words, sizeof(Uint64));	//Rows spread along the row, at the row number modulo 3
+	
+	if(packed == NULL || raw == NULL || dilated == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	//The band packs the row above it again, and the row below it, so it never reads the bits another band writes
+	int last = (end<h) ? end : h;
+	for (int y=(start>0) ? start-1 : 0; y<=last; y++)
+	{
+		//Only black pixels away from the border spread, so the first and last pixel are cleared and the top and bottom rows stay 0.
+		//The row keeps its own black pixels, border or not.
+		if (y<h)
+		{
+			Uint64 *row = raw+(y%3)*words;
+			Kernels.pack_edge_row(thicken->pixels+(Sint64)y*w, row, w);
+			if (y>0 && y<h-1)
+			{
+				memcpy(packed, row, words*sizeof(Uint64));
+				packed[0] &= ~(Uint64)1;
+				packed[(w-1)/64] &= ~((Uint64)1 << ((w-1)%64));
+				DilateEdgeRow(packed, dilated+(y%3)*words, words);
+			}
+		}
+		if (y==h-1 || y==h)
+		{
+			memset(dilated+(y%3)*words, 0, words*sizeof(Uint64));
+		}
+		
+		//The row above now has the rows of bits above, at and below it
+		if (y>start)
+		{
+			const Uint64 *up = dilated+((y+1)%3)*words;
+			const Uint64 *row = dilated+((y-1)%3)*words;
+			const Uint64 *down = dilated+(y%3)*words;
+			const Uint64 *own = raw+((y-1)%3)*words;
+			Uint64 *line = thicken->edges+(Sint64)(y-1)*words;
+			for (int i=0; i<words; i++)
+			{
+				line[i] = own[i] | up[i] | row[i] | down[i];
+			}
+		}
+	}
+	
+	free(dilated);
+	free(raw);
+	free(packed);
+}
+
+void ThickenEdges(int h, int w, Uint32 *pixels, int stroke_width, Uint64 *edges, ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The height of the image.
+	int w:	The width of the image.
+	Uint32 *pixels:	The pixels which contains the edge detection. They are not changed.
+	int stroke_width:	The width of the strokes in pixels. 0 thickens the edges by one pixel all round.
+	Uint64 *edges:	The array which will store the thickened edges, one bit for every pixel and (w+63)/64 words to a row.
+	ThreadPool *pool:	The thread pool to share the bands of rows with.
+	
+	Every black pixel away from the border of the image turns its 3x3 neighbourhood black. The edges are kept as one bit
+	for every pixel and spread along the rows with shifts, then down the columns by ORing the rows above and below.
+	Only three rows of spread bits are kept, and a row is only finished once the row below it has been packed.
+	The edges are kept as bits rather than drawn on the pixels, so BenDay can combine them with the image as it writes it.*/
+	
+	if (stroke_width > 0)
+	{
+		StrokeEdges(h, w, pixels, stroke_width, edges, pool);
+		return;
+	}
+	
+	ThickenBands thicken = {pixels, edges, NULL, h, w, 0, 0};
+	ShareBands(pool, BandCount(pool, h, (Sint64)w*h), h, ThickenBand, &thicken);
+}
+
+//Create a function to work out the standard deviation of the blur SoftEdges makes the soft edges with
+double SoftEdgeSigma(int stroke_width)
+{
+	/*Parameters are...
+	int stroke_width:	The width of the strokes in pixels. 0 is the edges thickened by one pixel all round, which are 3 pixels wide.
+	Returns half the width of the thickened edges, so their shadow spreads about as far as they are wide.*/
+	
+	return ((stroke_width > 0) ? stroke_width : 3)/2.0;
+}
+
+//Create a function to blur the thickened edges into grey levels, for --blend=multiply
+void SoftEdges(int h, int w, const Uint64 *edges, Uint32 *pixels, int stroke_width, ThreadPool *pool)
+{
+	/*Parameters are...
+	int h:	The height of the image.
+	int w:	The width of the image.
+	const Uint64 *edges:	The thickened edges from ThickenEdges, one bit for every pixel.
+	Uint32 *pixels:	The pixels which will store the soft edges, from black in the middle of the thickened edges to white away from them.
+	int stroke_width:	The width of the strokes in pixels, which gives the size of the blur with SoftEdgeSigma.
+	ThreadPool *pool:	The thread pool to share the blur with.
+	
+	The edge detection is only black or white, and the thickened edges are black over all of its black pixels, so multiplying
+	the image with it would give the same image as drawing the edges over it. The blured edges shade the image around them instead.
+	A pixel only depends on the edges up to BoxReach(SoftEdgeSigma(stroke_width)) rows away.*/
+	
+	int words = (w+63)/64;
+	for (int y=0; y<h; y++)
+	{
+		for (int x=0; x<w; x++)
+		{
+			pixels[(Sint64)y*w + x] = ((edges[(Sint64)y*words + x/64] >> (x%64)) & 1) ? BENDAY_BLACK : BENDAY_WHITE;
+		}
+	}
+	
+	Uint16 *plane = malloc((Sint64)h*w*sizeof(Uint16));
+	
+	if(plane == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	GaussianBoxBlur(h, w, pixels, SoftEdgeSigma(stroke_width), plane, pool);
+	for (Sint64 i=0; i<(Sint64)w*h; i++)
+	{
+		Uint32 v = (plane[i] + 128) >> 8;
+		pixels[i] = (0xFFu<<24) | (v<<16) | (v<<8) | v;
+	}
+	
+	free(plane);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Reading and writing an image a strip of rows at a time, for --strip-rows. SDL_image only decodes and saves whole images,
+//so PNG and JPEG files are read with libpng and libjpeg, and the Ben Day image is written with libpng.
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Kinds of image a row reader reads from
+#define ROW_READER_DECODED 0	//An image decoded whole by SDL_image
+#define ROW_READER_PNG 1	//A PNG file read with libpng
+#define ROW_READER_JPEG 2	//A JPEG file read with libjpeg
+
+//The error handler of libjpeg, which jumps back out of the reading instead of ending the program
+typedef struct JpegError
+{
+	struct jpeg_error_mgr manager;	//The standard error handler, which prints the message
+	jmp_buf jump;	//Where to jump back to
+} JpegError;
+
+void JpegErrorExit(j_common_ptr jpeg)
+{
+	JpegError *error = (JpegError *) jpeg->err;
+	(*jpeg->err->output_message)(jpeg);
+	longjmp(error->jump, 1);
+}
+
+//An image read from the top down a few rows at a time
+typedef struct RowReader
+{
+	int kind;	//ROW_READER_DECODED, ROW_READER_PNG or ROW_READER_JPEG
+	int w;	//The width of the image
+	int h;	//The height of the image
+	int next;	//The next row to be read
+	const Uint32 *pixels;	//The pixels of a decoded image
+	FILE *file;	//The file of a PNG or JPEG image
+	png_structp png;	//The libpng reader of a PNG image
+	png_infop info;	//Its header
+	struct jpeg_decompress_struct jpeg;	//The libjpeg reader of a JPEG image
+	JpegError error;	//Its error handler
+	Uint8 *row;	//A row as libpng or libjpeg gives it
+} RowReader;
+
+//Create a function to read rows from an image which is already decoded
+void DecodedRowReader(RowReader *reader, const SDL_Surface *surface)
+{
+	/*Parameters are...
+	RowReader *reader:	The reader to be filled in.
+	const SDL_Surface *surface:	The decoded image in ARGB8888. It has to be kept until the reader is closed.*/
+	
+	memset(reader, 0, sizeof(RowReader));
+	reader->kind = ROW_READER_DECODED;
+	reader->w = surface->w;
+	reader->h = surface->h;
+	reader->pixels = (const Uint32 *) surface->pixels;
+}
+
+//Create a function to free a row reader and close its file
+void CloseRowReader(RowReader *reader)
+{
+	/*Parameters are...
+	RowReader *reader:	The reader to close. It can be closed more than once.*/
+	
+	if (reader->png != NULL)
+	{
+		png_destroy_read_struct(&reader->png, &reader->info, NULL);
+	}
+	if (reader->kind == ROW_READER_JPEG && reader->file != NULL)
+	{
+		jpeg_destroy_decompress(&reader->jpeg);
+	}
+	if (reader->file != NULL)
+	{
+		fclose(reader->file);
+	}
+	free(reader->row);
+	reader->png = NULL;
+	reader->info = NULL;
+	reader->file = NULL;
+	reader->row = NULL;
+}
+
+//Create a function to start reading a PNG or JPEG file a few rows at a time
+int OpenRowReader(RowReader *reader, const char *file)
+{
+	/*Parameters are...
+	RowReader *reader:	The reader to be filled in.
+	const char *file:	The file of the image.
+	Returns 1, or 0 if the file is not a PNG or JPEG file that can be read a few rows at a time. Interlaced PNG files and
+	JPEG files which are not RGB or greyscale are left to SDL_image, as their rows do not come out one after the other.*/
+	
+	memset(reader, 0, sizeof(RowReader));
+	reader->file = fopen(file, "rb");
+	if (reader->file == NULL)
+	{
+		return 0;
+	}
+	
+	Uint8 signature[8];
+	int length = fread(signature, 1, sizeof(signature), reader->file);
+	rewind(reader->file);
+	
+	if (length == 8 && png_sig_cmp(signature, 0, 8) == 0)
+	{
+		reader->kind = ROW_READER_PNG;
+		reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		reader->info = (reader->png != NULL) ? png_create_info_struct(reader->png) : NULL;
+		
+		if(reader->png == NULL || reader->info == NULL)
+		{
+			printf("Insufficient memory\n");
+			exit(1);
+		}
+		
+		if (setjmp(png_jmpbuf(reader->png)))
+		{
+			CloseRowReader(reader);
+			return 0;
+		}
+		
+		png_init_io(reader->png, reader->file);
+		png_read_info(reader->png, reader->info);
+		if (png_get_interlace_type(reader->png, reader->info) != PNG_INTERLACE_NONE)
+		{
+			CloseRowReader(reader);
+			return 0;
+		}
+		
+		//Every PNG file comes out as 8 bit RGBA, like the ARGB8888 surfaces
+		png_set_expand(reader->png);
+		png_set_strip_16(reader->png);
+		png_set_gray_to_rgb(reader->png);
+		png_set_add_alpha(reader->png, 0xFF, PNG_FILLER_AFTER);
+		png_read_update_info(reader->png, reader->info);
+		
+		reader->w = png_get_image_width(reader->png, reader->info);
+		reader->h = png_get_image_height(reader->png, reader->info);
+		reader->row = malloc(png_get_rowbytes(reader->png, reader->info));
+	}
+	
+	else if (length >= 2 && signature[0] == 0xFF && signature[1] == 0xD8)
+	{
+		reader->kind = ROW_READER_JPEG;
+		reader->jpeg.err = jpeg_std_error(&reader->error.manager);
+		reader->error.manager.error_exit = JpegErrorExit;
+		
+		if (setjmp(reader->error.jump))
+		{
+			CloseRowReader(reader);
+			return 0;
+		}
+		
+		jpeg_create_decompress(&reader->jpeg);
+		jpeg_stdio_src(&reader->jpeg, reader->file);
+		jpeg_read_header(&reader->jpeg, TRUE);
+		if (reader->jpeg.jpeg_color_space != JCS_YCbCr && reader->jpeg.jpeg_color_space != JCS_RGB && reader->jpeg.jpeg_color_space != JCS_GRAYSCALE)
+		{
+			CloseRowReader(reader);
+			return 0;
+		}
+		
+		reader->jpeg.out_color_space = JCS_RGB;
+		jpeg_start_decompress(&reader->jpeg);
+		
+		reader->w = reader->jpeg.output_width;
+		reader->h = reader->jpeg.output_height;
+		reader->row = malloc((Sint64)reader->w*reader->jpeg.output_components);
+	}
+	
+	else
+	{
+		fclose(reader->file);
+		reader->file = NULL;
+		return 0;
+	}
+	
+	if(reader->row == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	return 1;
+}
+
+//Create a function to read the next rows of an image
+int ReadRows(RowReader *reader, Uint32 *pixels, int rows)
+{
+	/*Parameters are...
+	RowReader *reader:	The reader of the image.
+	Uint32 *pixels:	The array which will store the ARGB8888 pixels of the rows.
+	int rows:	The number of rows to read. They must not go past the bottom of the image.
+	Returns 1, or 0 if the file is broken.*/
+	
+	int w = reader->w;
+	if (reader->kind == ROW_READER_DECODED)
+	{
+		memcpy(pixels, reader->pixels+(Sint64)reader->next*w, (Sint64)rows*w*sizeof(Uint32));
+		reader->next += rows;
+		return 1;
+	}
+	
+	if (reader->kind == ROW_READER_PNG)
+	{
+		if (setjmp(png_jmpbuf(reader->png)))
+		{
+			return 0;
+		}
+		
+		for (int y=0; y<rows; y++)
+		{
+			png_read_row(reader->png, reader->row, NULL);
+			Uint8 *rgba = reader->row;
+			for (int x=0; x<w; x++)
+			{
+				pixels[(Sint64)y*w + x] = ((Uint32)rgba[4*x+3]<<24) | PACK_RGB(rgba[4*x], rgba[4*x+1], rgba[4*x+2]);
+			}
+		}
+	}
+	
+	else
+	{
+		if (setjmp(reader->error.jump))
+		{
+			return 0;
+		}
+		
+		for (int y=0; y<rows; y++)
+		{
+			JSAMPROW row = reader->row;
+			jpeg_read_scanlines(&reader->jpeg, &row, 1);
+			Uint8 *rgb = reader->row;
+			for (int x=0; x<w; x++)
+			{
+				pixels[(Sint64)y*w + x] = 0xFF000000u | PACK_RGB(rgb[3*x], rgb[3*x+1], rgb[3*x+2]);
+			}
+		}
+	}
+	
+	reader->next += rows;
+	return 1;
+}
+
+//A PNG file written from the top down a few rows at a time
+typedef struct RowWriter
+{
+	int w;	//The width of the image
+	int h;	//The height of the image
+	int next;	//The next row to be written
+	FILE *file;	//The file written to
+	png_structp png;	//The libpng writer
+	png_infop info;	//The header of the image
+	Uint8 *row;	//A row in RGBA for libpng
+} RowWriter;
+
+//Create a function to start writing a PNG file a few rows at a time
+int OpenRowWriter(RowWriter *writer, const char *file, int w, int h)
+{
+	/*Parameters are...
+	RowWriter *writer:	The writer to be filled in.
+	const char *file:	The file to write to.
+	int w:	The width of the image.
+	int h:	The height of the image.
+	Returns 1, or 0 if the file cannot be written.
+	
+	The image is written as 8 bit RGBA, like IMG_SavePNG writes an ARGB8888 surface.*/
+	
+	memset(writer, 0, sizeof(RowWriter));
+	writer->w = w;
+	writer->h = h;
+	writer->file = fopen(file, "wb");
+	if (writer->file == NULL)
+	{
+		return 0;
+	}
+	
+	writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	writer->info = (writer->png != NULL) ? png_create_info_struct(writer->png) : NULL;
+	writer->row = malloc((Sint64)w*4);
+	
+	if(writer->png == NULL || writer->info == NULL || writer->row == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	if (setjmp(png_jmpbuf(writer->png)))
+	{
+		return 0;
+	}
+	
+	png_init_io(writer->png, writer->file);
+	png_set_IHDR(writer->png, writer->info, w, h, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(writer->png, writer->info);
+	return 1;
+}
+
+//Create a function to write the next rows of a PNG file
+int WriteRows(RowWriter *writer, const Uint32 *pixels, int rows)
+{
+	/*Parameters are...
+	RowWriter *writer:	The writer of the image.
+	const Uint32 *pixels:	The ARGB8888 pixels of the rows.
+	int rows:	The number of rows to write. They must not go past the bottom of the image.
+	Returns 1, or 0 if the file cannot be written.*/
+	
+	if (setjmp(png_jmpbuf(writer->png)))
+	{
+		return 0;
+	}
+	
+	int w = writer->w;
+	for (int y=0; y<rows; y++)
+	{
+		for (int x=0; x<w; x++)
+		{
+			Uint32 pixel = pixels[(Sint64)y*w + x];
+			writer->row[4*x] = CHANNEL(pixel,0);
+			writer->row[4*x+1] = CHANNEL(pixel,1);
+			writer->row[4*x+2] = CHANNEL(pixel,2);
+			writer->row[4*x+3] = pixel>>24;
+		}
+		png_write_row(writer->png, writer->row);
+	}
+	
+	writer->next += rows;
+	if (writer->next == writer->h)
+	{
+		png_write_end(writer->png, writer->info);
+	}
+	return 1;
+}
+
+//Create a function to free a row writer and close its file
+int CloseRowWriter(RowWriter *writer)
+{
+	/*Parameters are...
+	RowWriter *writer:	The writer to close.
+	Returns 1 if every row was written and the file was closed without an error, or 0.*/
+	
+	int written = (writer->next == writer->h);
+	if (writer->png != NULL)
+	{
+		png_destroy_write_struct(&writer->png, &writer->info);
+	}
+	if (writer->file != NULL && fclose(writer->file) != 0)
+	{
+		written = 0;
+	}
+	free(writer->row);
+	writer->file = NULL;
+	writer->row = NULL;
+	return written;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Working on one image, from the decoded image to the finished Ben Day image.
+//Used for the image shown in the window and for every image of a headless batch.
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct WorkingImage
+{
+	int w;	//The width of the image
+	int h;	//The height of the image
+	SDL_Surface *OriginalSurface;	//The decoded image in ARGB8888
+	SDL_Surface *BluredSurface;	//The edge detection
+	SDL_Surface *QuantizedSurface;	//The finished Ben Day image
+	Uint8 *Palette_Index;	//The palette index of every pixel
+	Uint32 Palette_Colours[256];	//The pixels of the colours of the palette
+	int colour_palette_no;	//The number of colours in the colour palette
+	Uint64 *Edge_Bits;	//The thickened edges, (w+63)/64 words to a row
+	const char *file;	//The file of an image read a strip of rows at a time
+} WorkingImage;
+
+//Create a function to decode an image into a working image
+int LoadWorkingImage(WorkingImage *image, const char *file)
+{
+	/*Parameters are...
+	WorkingImage *image:	The working image to be filled in.
+	const char *file:	The file of the image.
+	Returns 1, or 0 if the file cannot be loaded.
+	
+	The image is decoded and converted to ARGB8888 once, and the decoded surface is freed.*/
+	
+	memset(image, 0, sizeof(WorkingImage));
+	
+	SDL_Surface *LoadedImage = IMG_Load(file);
+	if (!LoadedImage)
+	{
+		return 0;
+	}
+	
+	image->w = LoadedImage->w;
+	image->h = LoadedImage->h;
+	image->OriginalSurface = SDL_ConvertSurfaceFormat(LoadedImage, SDL_PIXELFORMAT_ARGB8888,0);
+	SDL_FreeSurface(LoadedImage);
+	
+	if(image->OriginalSurface == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	return 1;
+}
+
+//Create a function to start working on an image which is read a strip of rows at a time
+int OpenWorkingImage(WorkingImage *image, const char *file)
+{
+	/*Parameters are...
+	WorkingImage *image:	The working image to be filled in.
+	const char *file:	The file of the image.
+	Returns 1, or 0 if the file cannot be loaded.
+	
+	Only the size of a PNG or JPEG file is read here, and its rows are read by StreamWorkingImage. Other files are decoded whole.*/
+	
+	RowReader reader;
+	int loaded = 1;
+	if (OpenRowReader(&reader, file))
+	{
+		memset(image, 0, sizeof(WorkingImage));
+		image->w = reader.w;
+		image->h = reader.h;
+		CloseRowReader(&reader);
+	}
+	else
+	{
+		loaded = LoadWorkingImage(image, file);
+	}
+	
+	image->file = file;
+	return loaded;
+}
+
+//Create a function to start reading the rows of a working image from the top
+int ReadWorkingImage(RowReader *reader, WorkingImage *image)
+{
+	/*Parameters are...
+	RowReader *reader:	The reader to be filled in.
+	WorkingImage *image:	The working image, from OpenWorkingImage.
+	Returns 1, or 0 if its file cannot be read any more.*/
+	
+	if (image->OriginalSurface != NULL)
+	{
+		DecodedRowReader(reader, image->OriginalSurface);
+		return 1;
+	}
+	return OpenRowReader(reader, image->file) && reader->w == image->w && reader->h == image->h;
+}
+
+//Create a function to read an image a strip of rows at a time and gather what its colour palette and two tones are made from
+int GatherImageStatistics(RowReader *reader, int strip, Uint32 *rows, const BenDayOptions *options, PaletteSource *source, TwoToneBands *tones, ThreadPool *pool)
+{
+	/*Parameters are...
+	RowReader *reader:	The reader of the image, at its first row.
+	int strip:	The number of rows read at a time.
+	Uint32 *rows:	The array the rows are read into, with room for strip rows.
+	const BenDayOptions *options:	The program options, which say what the colour palette is made from.
+	PaletteSource *source:	What ColourPalette makes the colour palette from, to be filled in. Its samples and cells are to be freed by the caller.
+	TwoToneBands *tones:	The two tones and what MapToneBand needs to give every pixel the closer one, to be filled in.
+	ThreadPool *pool:	The thread pool to share the rows with.
+	Returns 1, or 0 if the file is broken.
+	
+	This gathers the same counts, sums and samples as TwoTonePalette and BuildColourPalette take from a whole image, so the two tones
+	and the colour palette come out the same. The median the two tones are split at is only known once every row has been counted,
+	so the colours are added up for every value of every channel instead of only below, at and above the median.*/
+	
+	int w = reader->w;
+	int h = reader->h;
+	Sint64 size = (Sint64)w*h;
+	
+	//The exact median cut moves the colours around, so it gets a copy of the samples, or of every pixel when there are fewer
+	memset(source, 0, sizeof(PaletteSource));
+	source->w = w;
+	source->h = h;
+	int sampling = options->palette_samples > 0 && options->palette_samples < size;
+	if (options->palette_samples > 0 || options->quantizer == QUANTIZER_EXACT)
+	{
+		source->sample_count = sampling ? options->palette_samples : size;
+		source->samples = malloc(source->sample_count*sizeof(Uint32));
+		
+		if(source->samples == NULL)
+		{
+			printf("Insufficient memory\n");
+			exit(1);
+		}
+	}
+	
+	//The histogram quantizer and k-means bin every pixel into the colour histogram as it is read
+	else if (options->quantizer == QUANTIZER_HISTOGRAM || options->kmeans_iterations > 0)
+	{
+		source->cells = calloc(HISTOGRAM_SIZE, sizeof(HistogramCell));
+		
+		if(source->cells == NULL)
+		{
+			printf("Insufficient memory\n");
+			exit(1);
+		}
+	}
+	
+	int bands = BandCount(pool, strip, (Sint64)strip*w);
+	memset(tones, 0, sizeof(TwoToneBands));
+	tones->source = rows;
+	tones->w = w;
+	tones->count = malloc(bands*sizeof(*tones->count));
+	tones->value_total = malloc(bands*sizeof(*tones->value_total));
+	
+	if(tones->count == NULL || tones->value_total == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	Sint64 count[3][256];
+	Uint64 value_total[3][256][3];
+	memset(count, 0, sizeof(count));
+	memset(value_total, 0, sizeof(value_total));
+	
+	for (int top=0; top<h; top+=strip)
+	{
+		int strip_h = (top+strip<h) ? strip : h-top;
+		if (!ReadRows(reader, rows, strip_h))
+		{
+			free(tones->count);
+			free(tones->value_total);
+			tones->count = NULL;
+			tones->value_total = NULL;
+			return 0;
+		}
+		
+		//Count every channel, and add up the colours at every value of it
+		int strip_bands = BandCount(pool, strip_h, (Sint64)strip_h*w);
+		ShareBands(pool, strip_bands, strip_h, CountToneValuesBand, tones);
+		for (int band=0; band<strip_bands; band++)
+		{
+			for (int column=0; column<3; column++)
+			{
+				for (int value=0; value<256; value++)
+				{
+					count[column][value] += tones->count[band][column][value];
+					value_total[column][value][0] += tones->value_total[band][column][value][0];
+					value_total[column][value][1] += tones->value_total[band][column][value][1];
+					value_total[column][value][2] += tones->value_total[band][column][value][2];
+				}
+			}
+		}
+		
+		if (sampling)
+		{
+			source->sample_count = StratifiedSampleRows(rows, w, h, top, top+strip_h, options->palette_samples, source->samples);
+		}
+		else if (source->samples != NULL)
+		{
+			for (Sint64 i=0; i<(Sint64)strip_h*w; i++)
+			{
+				source->samples[(Sint64)top*w + i] = rows[i] & 0xFFFFFF;
+			}
+		}
+		else if (source->cells != NULL)
+		{
+			BinColourHistogram(rows, (Sint64)strip_h*w, source->cells);
+		}
+		
+		if (options->palette_reuse >= 0)
+		{
+			source->error_count = StratifiedSampleRows(rows, w, h, top, top+strip_h, PALETTE_ERROR_SAMPLES, source->error_samples);
+		}
+	}
+	
+	if (source->cells != NULL)
+	{
+		source->cellcount = CompactColourHistogram(source->cells);
+	}
+	
+	free(tones->count);
+	free(tones->value_total);
+	tones->count = NULL;
+	tones->value_total = NULL;
+	
+	//Split the colours below, at and above the median on the longest axis
+	Sint64 below;
+	ToneMedian(count, size, tones, &below);
+	
+	Uint64 lower[3] = {0}, upper[3] = {0}, middle[3] = {0};
+	for (int value=0; value<256; value++)
+	{
+		Uint64 *total = (value < tones->median) ? lower : ((value == tones->median) ? middle : upper);
+		for (int column=0; column<3; column++)
+		{
+			total[column] += value_total[tones->longestColumn][value][column];
+		}
+	}
+	
+	SetTwoTones(tones, count[tones->longestColumn][tones->median], size, below, lower, middle, upper);
+	return 1;
+}
+
+//Create a function to turn a working image into the Ben Day image a strip of rows at a time, and write it to a PNG file
+int StreamWorkingImage(WorkingImage *image, const char *output_file, const BenDayOptions *options, ThreadPool *pool, PaletteCache *palette, TemplateCache *templates)
+{
+	/*Parameters are...
+	WorkingImage *image:	The working image, from OpenWorkingImage.
+	const char *output_file:	The PNG file the Ben Day image is written to.
+	const BenDayOptions *options:	The program options. --strip-rows gives the number of rows of a strip.
+	ThreadPool *pool:	The thread pool to share the work with.
+	PaletteCache *palette:	The colour palette kept from the previous image for --palette-reuse.
+	TemplateCache *templates:	The template given with --template, or NULL to use the built in dot screen.
+	Returns 1, or 0 if the image could not be read or saved.
+	
+	The image is read twice. The first time the colour palette and the two tones of grey are gathered from it a strip at a time.
+	The second time every strip, with some rows either side of it, goes through the same functions as a whole image, as if it was an image of its own,
+	and is written out straight away. Rows far enough from where the strip is cut come out the same as in the whole image: the edge detection
+	needs 3 rows for the fixed kernels, or the widths of the box blurs added up and a row of signs for --edge-sigma, the thickening 2 rows
+	or half the stroke width, and the soft edges of --blend=multiply the reach of their blur. So for a PNG or JPEG file only a few strips
+	are held, and the Ben Day image is the same as the one ProcessWorkingImage makes. Other files are decoded whole by OpenWorkingImage, and read from the decoded image.*/
+	
+	int w = image->w;
+	int h = image->h;
+	int words = (w+63)/64;
+	
+	//Without a template the dots come from the built in screen, spaced for the size of the image unless --dot-pitch is given
+	HalftoneScreen screen;
+	double pitch = (options->dot_pitch > 0) ? options->dot_pitch : ((w<h) ? w : h)/100.0;
+	BuildHalftoneScreen(&screen, (pitch < 4) ? 4 : pitch, options->dot_angle);
+	
+	//The rows either side of a strip needed to blur its soft edges, the rows either side of those needed to thicken their edges,
+	//and the rows either side of those needed to find their edges
+	int soft_rows = (options->blend == BLEND_MULTIPLY) ? BoxReach(SoftEdgeSigma(options->stroke_width)) : 0;
+	int thicken_rows = (options->stroke_width > 0) ? options->stroke_width/2 + 1 : 2;
+	int edge_rows = 3;
+	if (options->edge_sigma[0] > 0)
+	{
+		for (int blur=0; blur<2; blur++)
+		{
+			int reach = 1 + BoxReach(options->edge_sigma[blur]);
+			if (reach > edge_rows) edge_rows = reach;
+		}
+	}
+	
+	int strip = options->strip_rows;
+	int around = strip + 2*(edge_rows+thicken_rows+soft_rows);
+	Uint32 *rows = malloc((Sint64)around*w*sizeof(Uint32));	//The rows read from the image, for the strip and the rows around it
+	
+	if(rows == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	//Gather the colour palette and the two tones of grey from the whole image
+	RowReader reader;
+	PaletteSource source = {NULL};
+	TwoToneBands tones;
+	int read = ReadWorkingImage(&reader, image) && GatherImageStatistics(&reader, strip, rows, options, &source, &tones, pool);
+	CloseRowReader(&reader);
+	
+	if (!read)
+	{
+		fprintf(stderr, "Couldn't read %s\n", image->file);
+		free(source.samples);
+		free(source.cells);
+		free(rows);
+		return 0;
+	}
+	
+	Uint32 colour_palette[256][3];
+	image->colour_palette_no = 16;	//The number of colours in the colour palette. It should be a power of 2.
+	InverseColourMap *colourmap = ColourPalette(&source, colour_palette, image->Palette_Colours, image->colour_palette_no, options, pool, palette);
+	printf("\n\n");
+	free(source.samples);
+	free(source.cells);
+	
+	Uint32 *grey = malloc((Sint64)around*w*sizeof(Uint32));	//The two tone grey of the strip and the rows around it
+	Uint32 *edge = malloc((Sint64)around*w*sizeof(Uint32));	//Their edge detection
+	Uint64 *bits = malloc((Sint64)(strip + 2*(thicken_rows+soft_rows))*words*sizeof(Uint64));	//The thickened edges of the strip and the rows either side of it
+	Uint8 *index = malloc((Sint64)strip*w);	//The palette index of every pixel of the strip
+	Uint32 *out = malloc((Sint64)strip*w*sizeof(Uint32));	//The Ben Day pixels of the strip, until they are written
+	
+	if(grey == NULL || edge == NULL || bits == NULL || index == NULL || out == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	//A template scaled to the image is only scaled a strip at a time, as the whole of it would take as much memory as the image.
+	//A repeated template is used as it is.
+	Uint32 *dots = NULL;	//The template scaled for the rows of the strip
+	if (templates != NULL && !options->template_tile)
+	{
+		dots = malloc((Sint64)strip*w*sizeof(Uint32));
+		if(dots == NULL)
+		{
+			printf("Insufficient memory\n");
+			exit(1);
+		}
+	}
+	
+	//Read the image again, and write every strip as soon as it is finished
+	RowWriter writer;
+	memset(&writer, 0, sizeof(RowWriter));
+	read = ReadWorkingImage(&reader, image);
+	int written = read && OpenRowWriter(&writer, output_file, w, h);
+	
+	int rows_top = 0;	//The first row of the image held in rows
+	int rows_held = 0;	//The number of rows held
+	for (int top=0; written && top<h; top+=strip)
+	{
+		int bottom = (top+strip<h) ? top+strip : h;
+		int soft_top = (top-soft_rows>0) ? top-soft_rows : 0;
+		int soft_bottom = (bottom+soft_rows<h) ? bottom+soft_rows : h;
+		int edge_top = (soft_top-thicken_rows>0) ? soft_top-thicken_rows : 0;
+		int edge_bottom = (soft_bottom+thicken_rows<h) ? soft_bottom+thicken_rows : h;
+		int grey_top = (edge_top-edge_rows>0) ? edge_top-edge_rows : 0;
+		int grey_bottom = (edge_bottom+edge_rows<h) ? edge_bottom+edge_rows : h;
+		
+		//Keep the rows the previous strip shares with this one, and read the rest
+		rows_held -= grey_top-rows_top;
+		memmove(rows, rows+(Sint64)(grey_top-rows_top)*w, (Sint64)rows_held*w*sizeof(Uint32));
+		rows_top = grey_top;
+		if (!ReadRows(&reader, rows+(Sint64)rows_held*w, grey_bottom-rows_top-rows_held))
+		{
+			read = 0;
+			break;
+		}
+		rows_held = grey_bottom-rows_top;
+		
+		//Two tone grey and edge detection of the strip and the rows around it
+		tones.source = rows;
+		tones.pixels = grey;
+		ShareBands(pool, BandCount(pool, grey_bottom-grey_top, (Sint64)(grey_bottom-grey_top)*w), grey_bottom-grey_top, MapToneBand, &tones);
+		EdgeDetection(grey_bottom-grey_top, w, grey, edge, options->edge_sigma, pool);
+		
+		//Thickening the edges of the strip and the rows either side of it, and bluring them into the soft edges of the strip to multiply with
+		ThickenEdges(edge_bottom-edge_top, w, edge+(Sint64)(edge_top-grey_top)*w, options->stroke_width, bits, pool);
+		if (options->blend == BLEND_MULTIPLY)
+		{
+			SoftEdges(soft_bottom-soft_top, w, bits+(Sint64)(soft_top-edge_top)*words, edge+(Sint64)(soft_top-grey_top)*w, options->stroke_width, pool);
+		}
+		
+		MapColourPalette(colourmap, colour_palette, rows+(Sint64)(top-grey_top)*w, index, w, bottom-top, pool);
+		
+		//The rows of a template scaled for the strip start at the strip, so it is given as a template of the strip's height.
+		//The dot screen is only used without a template, so the first row only has to be given to it or to a repeated template.
+		if (dots != NULL)
+		{
+			ScaleTemplateRows(templates->template, w, h, top, bottom-top, dots);
+			BenDay(bottom-top, w, out, index, image->Palette_Colours, image->colour_palette_no, dots, w, bottom-top, &screen,
+				edge+(Sint64)(top-grey_top)*w, bits+(Sint64)(top-edge_top)*words, options->blend, 0, pool);
+		}
+		else
+		{
+			BenDay(bottom-top, w, out, index, image->Palette_Colours, image->colour_palette_no,
+				(templates != NULL) ? (Uint32 *) templates->template->pixels : NULL, (templates != NULL) ? templates->template->w : w,
+				(templates != NULL) ? templates->template->h : h, &screen, edge+(Sint64)(top-grey_top)*w, bits+(Sint64)(top-edge_top)*words,
+				options->blend, top, pool);
+		}
+		
+		written = WriteRows(&writer, out, bottom-top);
+	}
+	
+	written = CloseRowWriter(&writer) && written;
+	CloseRowReader(&reader);
+	if (!read)
+	{
+		fprintf(stderr, "Couldn't read %s\n", image->file);
+	}
+	else if (!written)
+	{
+		fprintf(stderr, "Saving %s has failed\n", output_file);
+	}
+	
+	free(dots);
+	free(out);
+	free(index);
+	free(bits);
+	free(edge);
+	free(grey);
+	free(rows);
+	FreeInverseColourMap(colourmap);
+	return read && written;
+}
+
+//Create a function to turn a decoded working image into the Ben Day image
+void ProcessWorkingImage(WorkingImage *image, const BenDayOptions *options, ThreadPool *pool, PaletteCache *palette, TemplateCache *templates)
+{
+	/*Parameters are...
+	WorkingImage *image:	The working image, from LoadWorkingImage.
+	const BenDayOptions *options:	The program options.
+	ThreadPool *pool:	The thread pool to share the work with.
+	PaletteCache *palette:	The colour palette kept from the previous image for --palette-reuse.
+	TemplateCache *templates:	The template given with --template, or NULL to use the built in dot screen.
+	
+	The colour quantization only reads the original, and the edge detection and BenDay write every pixel of their own surfaces,
+	so those start out empty. The Ben Day surface is only written at the end, so it holds the two tone grey image for the
+	edge detection until then, which lets every band of the edge detection read the grey rows of its neighbours.*/
+	
+	int w = image->w;
+	int h = image->h;
+	image->BluredSurface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+	image->QuantizedSurface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+	image->Palette_Index = malloc((Sint64)w*h);
+	image->Edge_Bits = malloc((Sint64)h*((w+63)/64)*sizeof(Uint64));
+	
+	if(image->BluredSurface == NULL || image->QuantizedSurface == NULL || image->Palette_Index == NULL || image->Edge_Bits == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
+	
+	//Change the surface pixels from (void*)pixels to (Uint32*)pixels
+	Uint32 * pixels = (Uint32 *) image->BluredSurface -> pixels;
+	Uint32 * Quantized_Pixels = (Uint32 *) image->QuantizedSurface -> pixels;
+	Uint32 * Original_Pixels = (Uint32 *) image->OriginalSurface -> pixels;
+	
+	//Take the template scaled to the size of the image from the cache, or as it is to repeat it across the image
+	SDL_Surface *BenDaySurface = NULL;
+	if (templates != NULL)
+	{
+		BenDaySurface = options->template_tile ? templates->template : GetScaledTemplate(templates, w, h);
+	}
+	Uint32 * BenDay_Pixels = (BenDaySurface != NULL) ? (Uint32 *) BenDaySurface -> pixels : NULL;
+	
+	//Without a template the dots come from the built in screen, spaced for the size of the image unless --dot-pitch is given
+	HalftoneScreen screen;
+	double pitch = (options->dot_pitch > 0) ? options->dot_pitch : ((w<h) ? w : h)/100.0;
+	BuildHalftoneScreen(&screen, (pitch < 4) ? 4 : pitch, options->dot_angle);
+	
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//Reducing colour palette of the image (Median Cut Colour Quantization)
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	image->colour_palette_no = 16;	//The number of colours in the colour palette. It should be a power of 2.
+	ColourQuantization(w, h, Original_Pixels, image->Palette_Index, image->Palette_Colours, image->colour_palette_no, options, pool, palette);
+	printf("\n\n");
+	
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//Creating Edge Detection (Convolution Blurring)
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	
+	//Set colours of QuantizedSurface to two tones of grey, like a grey colour palette of 2
+	TwoToneGrayscale(h, w, Original_Pixels, Quantized_Pixels, pool);
+	
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//EdgeDetection of the two tone grey image into BluredSurface
+	EdgeDetection(h, w, Quantized_Pixels, pixels, options->edge_sigma, pool);
+	printf("Image is still working. Message 1/3\n");
+	
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//Thickening the edges from edge detection, kept as one bit for every pixel
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	
+	ThickenEdges(h, w, pixels, options->stroke_width, image->Edge_Bits, pool);
+	
+	//Multiplying needs grey levels, so the edge detection is replaced with the thickened edges blured
+	if (options->blend == BLEND_MULTIPLY)
+	{
+		SoftEdges(h, w, image->Edge_Bits, pixels, options->stroke_width, pool);
+	}
+	printf("Image is still working. Message 2/3\n");
+	
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//Convert some colours to red/blue/yellow/black/white when appropriate and others to ben day dots template,
+	//and combine the edges with them, in one pass over the image
+	/////////////////////////////////////////////////////////////////////////////////////////////////
+	
+	//Combining Edge detection and colour quantized image, with CombineReplace or CombineMultiply for every row as --blend picks
+	BenDay(h, w, Quantized_Pixels, image->Palette_Index, image->Palette_Colours, image->colour_palette_no, BenDay_Pixels,
+		(BenDaySurface != NULL) ? BenDaySurface->w : w, (BenDaySurface != NULL) ? BenDaySurface->h : h, &screen, pixels, image->Edge_Bits, options->blend, 0, pool);
+	printf("Image is still working. Message 3/3\n");
+	
+	if (BenDaySurface != NULL && !options->template_tile)
+	{
+		ReleaseScaledTemplate(templates, BenDaySurface);
+	}
+}
+
+//Create a function to free everything of a working image but the finished Ben Day image
+void FreeWorkingPlanes(WorkingImage *image)
+{
+	/*Parameters are...
+	WorkingImage *image:	The working image. The freed parts are set to NULL.*/
+	
+	SDL_FreeSurface(image->OriginalSurface);
+	SDL_FreeSurface(image->BluredSurface);
+	free(image->Palette_Index);
+	free(image->Edge_Bits);
+	image->OriginalSurface = NULL;
+	image->BluredSurface = NULL;
+	image->Palette_Index = NULL;
+	image->Edge_Bits = NULL;
+}
+
+//Create a function to free a working image
+void FreeWorkingImage(WorkingImage *image)
+{
+	/*Parameters are...
+	WorkingImage *image:	The working image to free.*/
+	
+	FreeWorkingPlanes(image);
+	SDL_FreeSurface(image->QuantizedSurface);
+	image->QuantizedSurface = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Reading the program options
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Create a function to print how the program should be used
+void PrintUsage(char *program)
+{
+	/*Parameters are...
+	char *program:	The name of the program, argv[0].*/
+	
+	fprintf(stderr, "Usage should be: %s [options] <image_file> ...\n", program);
+	fprintf(stderr, "Options are...\n");
+	fprintf(stderr, "  --quantizer=exact|histogram	Median cut over every pixel or over a colour histogram. The default is exact,\n");
+	fprintf(stderr, "				or histogram with --strip-rows, where exact needs --palette-samples\n");
+	fprintf(stderr, "  --threads=<n>			Number of threads to use. The default is one for every CPU core\n");
+	fprintf(stderr, "  --palette-reuse=<error>	Reuse the previous image's colour palette while its sampled root mean square error\n");
+	fprintf(stderr, "				is at most <error> higher than on the image it was made from\n");
+	fprintf(stderr, "  --palette-samples=<n>		Make the colour palette from <n> pixels spread over the image instead of every pixel\n");
+	fprintf(stderr, "  --palette-report		Print the error of the sampled or k-means colour palette next to the exact one\n");
+	fprintf(stderr, "  --kmeans=<n>			Improve the median cut colour palette with at most <n> rounds of k-means\n");
+	fprintf(stderr, "  --simd=scalar|sse2|avx2|avx512	Widest vector instructions to use. The default is the widest the CPU has\n");
+	fprintf(stderr, "  --edge-sigma=<light>[,<heavy>]	Blur sizes of the edge detection in pixels, so the edges can be scaled with the image.\n");
+	fprintf(stderr, "				The heavy blur defaults to sqrt(2) times the light one. The default is the 3x3 and 5x5 kernels\n");
+	fprintf(stderr, "  --stroke-width=<n>		Draw the edges as round strokes <n> pixels wide. The default thickens them by one pixel all round\n");
+	fprintf(stderr, "  --template=<file>		Take the Ben Day dots from a template image, scaled to every image, instead of the built in screen\n");
+	fprintf(stderr, "  --template-tile			Repeat the template at its own size instead of scaling it\n");
+	fprintf(stderr, "  --template-cache=<MB>		Memory kept for the template scaled to the sizes of the images. The default is 256\n");
+	fprintf(stderr, "  --dot-pitch=<pixels>		Distance between the dots of the built in screen. The default is 1/100 of the shorter side\n");
+	fprintf(stderr, "  --dot-angle=<degrees>		Angle of the rows of dots of the built in screen. The default is 45\n");
+	fprintf(stderr, "  --blend=replace|multiply	Draw the edges over the image in black (default), or also shade the image around them\n");
+	fprintf(stderr, "				by multiplying it with the edges blured to half their width\n");
+	fprintf(stderr, "  --output=<dir>|<pattern>	Save every Ben Day image without opening a window, to <dir>/<name>.png or to the pattern\n");
+	fprintf(stderr, "				with its %%s replaced by the name of the image without its extension, and print the time taken\n");
+	fprintf(stderr, "  --batch-depth=<n>		Most images of an --output batch in memory at once. The default is one more than the threads\n");
+	fprintf(stderr, "  --strip-rows=<n>		Read, work on and write an --output image <n> rows at a time, so no whole image is kept.\n");
+	fprintf(stderr, "				The image is read twice. Files other than PNG and JPEG are still decoded whole. The colour palette\n");
+	fprintf(stderr, "				comes from the colour histogram or --palette-samples, and a template is scaled a strip at a time\n\n");
+}
+
+//Create a function to read the options at the start of the command line
+int ParseOptions(int argc, char *argv[], BenDayOptions *options)
+{
+	/*Parameters are...
+	int argc:	The number of command line arguments.
+	char *argv[]:	The command line arguments.
+	BenDayOptions *options:	The options to be filled in.
+	Returns the index of the first argument that is not an option, or -1 if an option is wrong.*/
+	
+	options->quantizer = -1;
+	options->threads = 0;
+	options->palette_reuse = -1;
+	options->palette_samples = 0;
+	options->palette_report = 0;
+	options->kmeans_iterations = 0;
+	options->simd = SIMD_AVX512;
+	options->edge_sigma[0] = 0;
+	options->edge_sigma[1] = 0;
+	options->stroke_width = 0;
+	options->template_file = NULL;
+	options->dot_pitch = 0;
+	options->dot_angle = 45;
+	options->template_tile = 0;
+	options->template_cache = 256;
+	options->blend = BLEND_REPLACE;
+	options->output = NULL;
+	options->batch_depth = 0;
+	options->strip_rows = 0;
+	
+	int i = 1;
+	for (; i<argc && strncmp(argv[i], "--", 2) == 0; i++)
+	{
+		if (strcmp(argv[i], "--quantizer=exact") == 0)
+		{
+			options->quantizer = QUANTIZER_EXACT;
+		}
+		
+		else if (strcmp(argv[i], "--quantizer=histogram") == 0)
+		{
+			options->quantizer = QUANTIZER_HISTOGRAM;
+		}
+		
+		else if (strcmp(argv[i], "--blend=replace") == 0)
+		{
+			options->blend = BLEND_REPLACE;
+		}
+		
+		else if (strcmp(argv[i], "--blend=multiply") == 0)
+		{
+			options->blend = BLEND_MULTIPLY;
+		}
+		
+		else if (strncmp(argv[i], "--threads=", 10) == 0 && atoi(argv[i]+10) >= 0)
+		{
+			options->threads = atoi(argv[i]+10);
+		}
+		
+		else if (strncmp(argv[i], "--palette-reuse=", 16) == 0 && atof(argv[i]+16) >= 0)
+		{
+			options->palette_reuse = atof(argv[i]+16);
+		}
+		
+		else if (strncmp(argv[i], "--palette-samples=", 18) == 0 && atoi(argv[i]+18) >= 0)
+		{
+			options->palette_samples = atoi(argv[i]+18);
+		}
+		
+		else if (strcmp(argv[i], "--palette-report") == 0)
+		{
+			options->palette_report = 1;
+		}
+		
+		else if (strncmp(argv[i], "--kmeans=", 9) == 0 && atoi(argv[i]+9) >= 0)
+		{
+			options->kmeans_iterations = atoi(argv[i]+9);
+		}
+		
+		else if (strncmp(argv[i], "--simd=", 7) == 0)
+		{
+			const char *names[4] = {"scalar", "sse2", "avx2", "avx512"};
+			options->simd = -1;
+			for (int z=0; z<4; z++)
+			{
+				if (strcmp(argv[i]+7, names[z]) == 0) options->simd = z;
+			}
+			if (options->simd < 0)
+			{
+				fprintf(stderr, "Unknown option %s\n", argv[i]);
+				return -1;
+			}
+		}
+		
+		else if (strncmp(argv[i], "--edge-sigma=", 13) == 0 && atof(argv[i]+13) > 0)
+		{
+			//The heavy blur is sqrt(2) times the light one unless it is given, as with the 3x3 and 5x5 kernels
+			char *heavy = strchr(argv[i]+13, ',');
+			options->edge_sigma[0] = atof(argv[i]+13);
+			options->edge_sigma[1] = (heavy != NULL) ? atof(heavy+1) : options->edge_sigma[0]*sqrt(2);
+			int light_radius[BOX_PASSES], heavy_radius[BOX_PASSES];
+			BoxRadii(options->edge_sigma[0], light_radius);
+			BoxRadii(options->edge_sigma[1], heavy_radius);
+			if (options->edge_sigma[1] <= options->edge_sigma[0] || memcmp(light_radius, heavy_radius, sizeof(light_radius)) == 0)
+			{
+				fprintf(stderr, "The heavy blur of %s has to be wider than the light one by at least a pixel of box blur\n", argv[i]);
+				return -1;
+			}
+		}
+		
+		else if (strncmp(argv[i], "--stroke-width=", 15) == 0 && atoi(argv[i]+15) > 0 && atoi(argv[i]+15) <= 65534)
+		{
+			options->stroke_width = atoi(argv[i]+15);
+		}
+		
+		else if (strncmp(argv[i], "--template=", 11) == 0 && argv[i][11] != '\0')
+		{
+			options->template_file = argv[i]+11;
+		}
+		
+		else if (strcmp(argv[i], "--template-tile") == 0)
+		{
+			options->template_tile = 1;
+		}
+		
+		else if (strncmp(argv[i], "--template-cache=", 17) == 0 && atoi(argv[i]+17) >= 0)
+		{
+			options->template_cache = atoi(argv[i]+17);
+		}
+		
+		else if (strncmp(argv[i], "--dot-pitch=", 12) == 0 && atof(argv[i]+12) >= 2)
+		{
+			options->dot_pitch = atof(argv[i]+12);
+		}
+		
+		else if (strncmp(argv[i], "--dot-angle=", 12) == 0)
+		{
+			options->dot_angle = atof(argv[i]+12);
+		}
+		
+		else if (strncmp(argv[i], "--output=", 9) == 0 && argv[i][9] != '\0')
+		{
+			//Only one %s may be given, and no other conversion, as the pattern is passed to snprintf
+			char *conversion = strchr(argv[i]+9, '%');
+			if (conversion != NULL && (conversion[1] != 's' || strchr(conversion+2, '%') != NULL))
+			{
+				fprintf(stderr, "The pattern of %s can only have one %%s in it\n", argv[i]);
+				return -1;
+			}
+			options->output = argv[i]+9;
+		}
+		
+		else if (strncmp(argv[i], "--batch-depth=", 14) == 0 && atoi(argv[i]+14) > 0)
+		{
+			options->batch_depth = atoi(argv[i]+14);
+		}
+		
+		else if (strncmp(argv[i], "--strip-rows=", 13) == 0 && atoi(argv[i]+13) > 0)
+		{
+			options->strip_rows = atoi(argv[i]+13);
+		}
+		
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return -1;
+		}
+	}
+	
+	//The window shows the edge detection and the palette of the whole image, so only headless images can be done in strips
+	if (options->strip_rows > 0 && options->output == NULL)
+	{
+		fprintf(stderr, "--strip-rows only works with --output\n");
+		return -1;
+	}
+	
+	//The exact median cut needs a copy of every pixel, so a strip at a time the colour palette comes from the colour histogram
+	//unless it is made from samples. The report compares with the exact median cut, so it cannot be made either.
+	if (options->quantizer < 0)
+	{
+		options->quantizer = (options->strip_rows > 0) ? QUANTIZER_HISTOGRAM : QUANTIZER_EXACT;
+	}
+	if (options->strip_rows > 0 && options->quantizer == QUANTIZER_EXACT && options->palette_samples == 0)
+	{
+		fprintf(stderr, "--strip-rows needs --quantizer=histogram or --palette-samples, as --quantizer=exact keeps every pixel\n");
+		return -1;
+	}
+	if (options->strip_rows > 0 && options->palette_report)
+	{
+		fprintf(stderr, "--palette-report does not work with --strip-rows, as it makes the exact colour palette from every pixel\n");
+		return -1;
+	}
+	
+	return i;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Initialising SDL Window, Renderer, Texture, Surfaces
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Create a function to work out where an image is saved to with --output
+void MakeOutputPath(char *path, int size, const char *output, const char *image)
+{
+	/*Parameters are...
+	char *path:	The array which will store the file name to save to.
+	int size:	The size of the array.
+	const char *output:	The directory, or the pattern with one %s in it, given with --output.
+	const char *image:	The file name of the image.*/
 	
-	if(BlurValueArray == NULL)
+	//Take the name of the image without its directory or extension
+	const char *name = image;
+	for (const char *c = image; *c != '\0'; c++)
 	{
-		printf("Insufficient memory\n");
-		exit(1);
+		if (*c == '/' || *c == '\\') name = c+1;
 	}
+	const char *extension = strrchr(name, '.');
+	int length = (extension != NULL && extension != name) ? (int)(extension-name) : (int)strlen(name);
 	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	
-	//Heavy Convolution Blurring
-	HeavyBlurValueArray = malloc(((h-2)*(w-2))*sizeof(Uint32));
+	char base[length+1];
+	memcpy(base, name, length);
+	base[length] = '\0';
 	
-	if(HeavyBlurValueArray == NULL)
+	if (strchr(output, '%') != NULL)
 	{
-		printf("Insufficient memory\n");
-		exit(1);
+		snprintf(path, size, output, base);
 	}
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Light Convolution Blurring
-	int counter = 0;
-	for (int y=1; y<(h-1); y++)
+	else
 	{
-		for(int x=1; x<(w-1); x++)
-		{
-			//Filter starts here.
-			Uint8 r1,r2,r3,r4,r5,r6,r7,r8,r9;
-			Uint8 g1;
-			Uint8 b1;
-			
-			SDL_GetRGB(pixels[(y-1)*w + (x-1)], BluredSurface->format, &r1,&g1,&b1);
-			r1= r1*1/16;
-
-			SDL_GetRGB(pixels[(y-1)*w + (x)], BluredSurface->format, &r2,&g1,&b1);
-			r2= r2*2/16;
-			
-			SDL_GetRGB(pixels[(y-1)*w + (x+1)], BluredSurface->format, &r3,&g1,&b1);
-			r3= r3*1/16;
-			
-			SDL_GetRGB(pixels[(y)*w + (x-1)], BluredSurface->format, &r4,&g1,&b1);
-			r4= r4*2/16;
-			
-			SDL_GetRGB(pixels[(y)*w + (x)], BluredSurface->format, &r5,&g1,&b1);
-			r5= r5*4/16;
-			
-			SDL_GetRGB(pixels[(y)*w + (x+1)], BluredSurface->format, &r6,&g1,&b1);
-			r6= r6*2/16;
-			
-			SDL_GetRGB(pixels[(y+1)*w + (x-1)], BluredSurface->format, &r7,&g1,&b1);
-			r7= r7*1/16;
-			
-			SDL_GetRGB(pixels[(y+1)*w + (x)], BluredSurface->format, &r8,&g1,&b1);
-			r8= r8*2/16;
-			
-			SDL_GetRGB(pixels[(y+1)*w + (x+1)], BluredSurface->format, &r9,&g1,&b1);
-			r9= r9*1/16;
-			
-			Uint32 BlurValue = r1+r2+r3+r4+r5+r6+r7+r8+r9;
-			BlurValueArray[counter] = BlurValue;
-			counter++;
-		}
+		snprintf(path, size, "%s/%s.png", output, base);
 	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//Headless batch of images given with --output. Decoding, working on and saving different images run at the same time
+//as tasks of the thread pool, with a limited number of images in memory at once.
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Batch;
+
+//An image of the batch
+typedef struct BatchImage
+{
+	struct Batch *batch;	//The batch it belongs to
+	int index;	//Its position in the batch
+	const char *file;	//The file of the image
+	WorkingImage image;	//Its surfaces and planes, from the decoded image to the Ben Day image
+	SDL_atomic_t waiting;	//The stages to finish before it can be worked on: its decoding, and with --palette-reuse the image before it
+	Uint64 start;	//When its decoding started
+} BatchImage;
+
+typedef struct Batch
+{
+	const BenDayOptions *options;	//The program options
+	ThreadPool *pool;	//The thread pool every stage runs on
+	PaletteCache *palette;	//The colour palette kept for --palette-reuse
+	TemplateCache *templates;	//The template given with --template, or NULL
+	BatchImage *images;	//Every image of the batch
+	int count;	//The number of images
+	SDL_atomic_t tasks;	//The unfinished tasks of the batch
+	SDL_atomic_t in_flight;	//The images started and not yet saved or given up on
+	SDL_atomic_t saved;	//The number of images saved
+	SDL_atomic_t failed;	//Set if an image could not be loaded or saved
+} Batch;
+
+void ProcessImageTask(void *data);
+
+//Create a function to mark one stage an image waits for as finished, and queue the work on it once none are left
+void ReadyToProcess(BatchImage *item)
+{
+	/*Parameters are...
+	BatchImage *item:	The image of the batch.*/
 	
-	//Assign blured values
-	counter = 0;
-	for (int y=1; y<(h-1); y++)
+	if (SDL_AtomicAdd(&item->waiting, -1) == 1)
 	{
-		for(int x=1; x<(w-1); x++)
-		{
-		Uint32 pixel = SDL_MapRGB(BluredSurface->format,BlurValueArray[counter],BlurValueArray[counter],BlurValueArray[counter]);
-		pixels[y*w+x] = pixel;
-		counter++;
-		}
+		SubmitTask(item->batch->pool, ProcessImageTask, item, &item->batch->tasks);
 	}
+}
+
+//Create a function to let the next image be worked on when the colour palette has to be passed on in order
+void ReleaseNextImage(BatchImage *item)
+{
+	/*Parameters are...
+	BatchImage *item:	The image of the batch whose work is finished or given up on.*/
 	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Heavy Convolution Blurring
-	counter = 0;
-	
-	for (int y=2; y<(h-2); y++)
+	Batch *batch = item->batch;
+	if (batch->options->palette_reuse >= 0 && item->index+1 < batch->count)
 	{
-		for(int x=2; x<(w-2); x++)
-		{
-			//Filter starts here.
-			Uint8 r1,r2,r3,r4,r5,r6,r7,r8,r9,r10,r11,r12,r13,r14,r15,r16,r17,r18,r19,r20,r21,r22,r23,r24,r25;
-			Uint8 g1;
-			Uint8 b1;
-			
-			SDL_GetRGB(GBS_Pixels[(y-2)*w + (x-2)], GreaterBluredSurface->format, &r1,&g1,&b1);
-			r1= r1*1/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y-2)*w + (x-1)], GreaterBluredSurface->format, &r2,&g1,&b1);
-			r2= r2*4/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y-2)*w + (x)], GreaterBluredSurface->format, &r3,&g1,&b1);
-			r3= r3*7/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y-2)*w + (x+1)], GreaterBluredSurface->format, &r4,&g1,&b1);
-			r4= r4*4/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y-2)*w + (x+2)], GreaterBluredSurface->format, &r5,&g1,&b1);
-			r5= r5*1/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y-1)*w + (x-2)], GreaterBluredSurface->format, &r6,&g1,&b1);
-			r6= r6*4/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y-1)*w + (x-1)], GreaterBluredSurface->format, &r7,&g1,&b1);
-			r7= r7*16/265;
-
-			SDL_GetRGB(GBS_Pixels[(y-1)*w + (x)], GreaterBluredSurface->format, &r8,&g1,&b1);
-			r8= r8*26/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y-1)*w + (x+1)], GreaterBluredSurface->format, &r9,&g1,&b1);
-			r9= r9*16/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y-1)*w + (x+2)], GreaterBluredSurface->format, &r10,&g1,&b1);
-			r10= r10*4/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y)*w + (x-2)], GreaterBluredSurface->format, &r11,&g1,&b1);
-			r11= r11*7/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y)*w + (x-1)], GreaterBluredSurface->format, &r12,&g1,&b1);
-			r12= r12*26/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y)*w + (x)], GreaterBluredSurface->format, &r13,&g1,&b1);
-			r13= r13*41/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y)*w + (x+1)], GreaterBluredSurface->format, &r14,&g1,&b1);
-			r14= r14*26/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y)*w + (x+2)], GreaterBluredSurface->format, &r15,&g1,&b1);
-			r15= r15*7/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+1)*w + (x-2)], GreaterBluredSurface->format, &r16,&g1,&b1);
-			r16= r16*4/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+1)*w + (x-1)], GreaterBluredSurface->format, &r17,&g1,&b1);
-			r17= r17*16/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+1)*w + (x)], GreaterBluredSurface->format, &r18,&g1,&b1);
-			r18= r18*26/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+1)*w + (x+1)], GreaterBluredSurface->format, &r19,&g1,&b1);
-			r19= r19*16/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+1)*w + (x+2)], GreaterBluredSurface->format, &r20,&g1,&b1);
-			r20= r20*4/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+2)*w + (x-2)], GreaterBluredSurface->format, &r21,&g1,&b1);
-			r21= r21*1/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+2)*w + (x-1)], GreaterBluredSurface->format, &r22,&g1,&b1);
-			r22= r22*4/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+2)*w + (x)], GreaterBluredSurface->format, &r23,&g1,&b1);
-			r23= r23*7/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+2)*w + (x+1)], GreaterBluredSurface->format, &r24,&g1,&b1);
-			r24= r24*4/265;
-			
-			SDL_GetRGB(GBS_Pixels[(y+2)*w + (x+2)], GreaterBluredSurface->format, &r25,&g1,&b1);
-			r25= r25*1/265;
-			
-			Uint32 HeavyBlurValue = r1+r2+r3+r4+r5+r6+r7+r8+r9+r10+r11+r12+r13+r14+r15+r16+r17+r18+r19+r20+r21+r22+r23+r24+r25;
-			
-			HeavyBlurValueArray[counter] = HeavyBlurValue;
-			counter++;
-		}
+		ReadyToProcess(&batch->images[item->index+1]);
 	}
+}
+
+//Create a function to count an image of the batch as saved or failed and free it
+void FinishBatchImage(BatchImage *item, const char *Output_file, int saved)
+{
+	/*Parameters are...
+	BatchImage *item:	The image of the batch.
+	const char *Output_file:	The file its Ben Day image was saved to.
+	int saved:	1 if it was saved, or 0 if it failed. The error has been printed already.*/
 	
-	counter=0;
-	for (int y=2; y<(h-2); y++)
+	Batch *batch = item->batch;
+	if (saved)
 	{
-		for(int x=2; x<(w-2); x++)
-		{
-		Uint32 pixel = SDL_MapRGB(GreaterBluredSurface->format,HeavyBlurValueArray[counter],HeavyBlurValueArray[counter],HeavyBlurValueArray[counter]);
-		GBS_Pixels[y*w+x] = pixel;
-		counter++;
-		}
+		printf("%s -> %s: %.3f s\n", item->file, Output_file, (double)(SDL_GetPerformanceCounter()-item->start)/SDL_GetPerformanceFrequency());
+		SDL_AtomicAdd(&batch->saved, 1);
 	}
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Subtract weaker gaussian from stronger gaussian to get edge detection
-	for (int y=0; y<h; y++)
+	else
 	{
-		for(int x=0; x<w; x++)
-		{
-		pixels[y*w+x] = GBS_Pixels[y*w+x]-pixels[y*w+x];
-		}
+		SDL_AtomicSet(&batch->failed, 1);
 	}
 	
-	printf("Image is still working. Message 1/5\n");
-	
-	free(HeavyBlurValueArray);
-	free(BlurValueArray);
+	FreeWorkingImage(&item->image);
+	SDL_AtomicAdd(&batch->in_flight, -1);
 }
 
-void BenDay(int h, int w, SDL_Surface *QuantizedSurface, Uint32 * Quantized_Pixels, SDL_Surface *BenDaySurface, Uint32 * BenDay_Pixels)
+//Create a task to save the Ben Day image of an image of the batch and free it
+void EncodeImageTask(void *data)
 {
 	/*Parameters are...
-	int h:	The height of the image.
-	int w:	The width of the image.
-	SDL_Surface *QuantizedSurface:	The surface which contains the image that is being edited on
-	Uint32 * Quantized_Pixels:	The pixels of the image to be edited on
-	SDL_Surface *BenDaySurface:	The surface which contains the image of the Ben Day Dots template
-	Uint32 * BenDay_Pixels:	The pixels of the Ben Day Dots template. */
+	void *data:	The image of the batch, a BatchImage.*/
 	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Convert colours close to red/blue/yellow/black and white to respective colours
+	BatchImage *item = data;
+	Batch *batch = item->batch;
 	
-	for (int y=0; y<h; y++)
+	char Output_file[4096];
+	MakeOutputPath(Output_file, sizeof(Output_file), batch->options->output, item->file);
+	int saved = IMG_SavePNG(item->image.QuantizedSurface, Output_file) >= 0;
+	if (!saved)
 	{
-		for(int x=0; x<w; x++)
-		{
-		Uint8 r1,g1,b1;
-		SDL_GetRGB(Quantized_Pixels[y*w + x], QuantizedSurface->format, &r1,&g1,&b1);
-		
-		
-		if (r1>150 && g1<50 && b1<50)	//Red
-		{
-		Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,200,0,0);
-		Quantized_Pixels[y*w+x] = pixel;
-		}
-		
-		if (r1<125 && g1<125 && b1>150)	//Blue
-		{
-		Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,0,40,170);
-		Quantized_Pixels[y*w+x] = pixel;
-		}
-	
-		if (r1>220 && g1>170 && b1<130)	//Yellow
-		{
-		Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,250,220,100);
-		Quantized_Pixels[y*w+x] = pixel;
-		}
-		
-		if (r1<100 && g1<100 && b1<100)	//Black
-		{
-		Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,0,0,0);
-		Quantized_Pixels[y*w+x] = pixel;
-		}
-		
-		if (r1>200 && g1>200 && b1>200)	//White
-		{
-		Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,255,255,255);
-		Quantized_Pixels[y*w+x] = pixel;
-		}
-		}
+		fprintf(stderr,"Saving %s has failed: %s\n", Output_file, SDL_GetError());
 	}
 	
-	printf("Image is still working. Message 2/5\n");
+	FinishBatchImage(item, Output_file, saved);
+}
+
+//Create a task to turn an image of the batch into its Ben Day image
+void ProcessImageTask(void *data)
+{
+	/*Parameters are...
+	void *data:	The image of the batch, a BatchImage.*/
 	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Convert non red/blue/yellow/black and white colours to ben day templates
-	for (int y=0; y<h; y++)
-	{
-		for(int x=0; x<w; x++)
-		{
-		Uint8 r1,g1,b1,r2,g2,b2;
-		SDL_GetRGB(Quantized_Pixels[y*w + x], QuantizedSurface->format, &r1,&g1,&b1);
-		SDL_GetRGB(BenDay_Pixels[y*w + x], BenDaySurface->format, &r2,&g2,&b2);
-		
-		if ((r1==200 && g1==0 && b1==0) || (r1==0 && g1==40 && b1==170) || (r1==250 && g1==220 && b1==100) || (r1==0 && g1==0 && b1==0) || (r1==255 && g1==255 && b1==255))
-			{
-			continue;
-			} 
-		
-		else
-			{
-			//if darker than a certain colour
-			if ((r1 + b1 + g1)<200)
-				{
-				if (r2!=255 && g2!=255 && b2!=255)	//if the ben day pixel is not white, change the pixel of the quantized image to white
-					{
-					Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,255,255,255);
-					Quantized_Pixels[y*w+x] = pixel;
-					}
-				}
-			
-			else
-				{
-				if (r2==255 && g2==255 && b2==255)	//if the ben day pixel is white, change the pixel of the quantized image to white
-					{
-					Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,255,255,255);
-					Quantized_Pixels[y*w+x] = pixel;
-					}
-				
-				}
-			}
-		}
+	BatchImage *item = data;
+	Batch *batch = item->batch;
 	
+	//With --strip-rows the Ben Day image is written as it is made, so it is saved here
+	if (batch->options->strip_rows > 0)
+	{
+		char Output_file[4096];
+		MakeOutputPath(Output_file, sizeof(Output_file), batch->options->output, item->file);
+		int saved = StreamWorkingImage(&item->image, Output_file, batch->options, batch->pool, batch->palette, batch->templates);
+		ReleaseNextImage(item);
+		FinishBatchImage(item, Output_file, saved);
+		return;
 	}
 	
-	printf("Image is still working. Message 3/5\n");
+	ProcessWorkingImage(&item->image, batch->options, batch->pool, batch->palette, batch->templates);
+	ReleaseNextImage(item);
+	
+	//Only the Ben Day image is needed to save it, so the rest is let go straight away
+	FreeWorkingPlanes(&item->image);
+	SubmitTask(batch->pool, EncodeImageTask, item, &batch->tasks);
 }
 
-void ThickenEdges(int h, int w, SDL_Surface *BluredSurface, Uint32 *pixels)
+//Create a task to decode an image of the batch
+void DecodeImageTask(void *data)
 {
 	/*Parameters are...
-	int h:	The height of the image.
-	int w:	The width of the image.
-	SDL_Surface *BluredSurface:	The surface which contains the edge detection.
-	Uint32 *pixels:	The pixels which contains the edge detection. */
+	void *data:	The image of the batch, a BatchImage.*/
+	
+	BatchImage *item = data;
+	Batch *batch = item->batch;
+	
+	//With --strip-rows a PNG or JPEG file is only opened here, and read as it is worked on
+	item->start = SDL_GetPerformanceCounter();
+	int loaded = (batch->options->strip_rows > 0) ? OpenWorkingImage(&item->image, item->file) : LoadWorkingImage(&item->image, item->file);
+	if (!loaded)
+	{
+		fprintf(stderr, "Couldn't load %s: %s\n", item->file, SDL_GetError());
+		SDL_AtomicSet(&batch->failed, 1);
+		ReleaseNextImage(item);
+		SDL_AtomicAdd(&batch->in_flight, -1);
+		return;
+	}
+	ReadyToProcess(item);
+}
+
+//Create a function to turn a batch of images into Ben Day images and save them
+int RunBatch(char *files[], int count, const BenDayOptions *options, ThreadPool *pool, PaletteCache *palette, TemplateCache *templates)
+{
+	/*Parameters are...
+	char *files[]:	The files of the images.
+	int count:	The number of images.
+	const BenDayOptions *options:	The program options. options->output says where the images are saved to.
+	ThreadPool *pool:	The thread pool to run the batch on.
+	PaletteCache *palette:	The colour palette kept for --palette-reuse.
+	TemplateCache *templates:	The template given with --template, or NULL to use the built in dot screen.
+	Returns 0, or 1 if an image could not be loaded or saved.
+	
+	Every image goes through three tasks, decoding, working on it and saving it, each one queueing the next. The images are started
+	in order, but only while fewer than the batch depth are decoded and not yet saved, which keeps the memory in use down.
+	The threads all take their work from the one queue, so a thread which is free takes the next stage of any image, or part of the
+	work on a large image, and a mix of small and large images keeps them all busy. The thread which starts the images also
+	runs tasks while it waits.
+	
+	With --palette-reuse every image needs the colour palette of the one before it, so the images are still worked on in order,
+	one at a time, while the others are decoded and saved.*/
 	
-	int *ThickenLinesArray = malloc(((h-1)*(w-1))*sizeof(int));
+	int depth = (options->batch_depth > 0) ? options->batch_depth : pool->thread_count+2;
+	Batch batch;
+	memset(&batch, 0, sizeof(Batch));
+	batch.options = options;
+	batch.pool = pool;
+	batch.palette = palette;
+	batch.templates = templates;
+	batch.images = calloc(count, sizeof(BatchImage));
+	batch.count = count;
 	
-	if(ThickenLinesArray == NULL)
+	if(batch.images == NULL)
 	{
 		printf("Insufficient memory\n");
 		exit(1);
 	}
 	
-	int counter = 0;
+	//Load the image libraries before the threads use them, so they do not each try to on their first image
+	IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG | IMG_INIT_TIF | IMG_INIT_WEBP);
 	
-	for (int y=1; y<h-1; y++)
+	Uint64 Batch_start = SDL_GetPerformanceCounter();
+	for (int i=0; i<count; i++)
 	{
-		for(int x=1; x<w-1; x++)
-		{
-		Uint8 r1,g1,b1;
-		SDL_GetRGB(pixels[(y)*w + (x)], BluredSurface->format, &r1,&g1,&b1);
-		if (r1==0 && g1==0 && b1==0)
-			{
-			int existed_element = 0;
-			for(int z=0; z<counter; z++)
-				{
-				if (((y*w)+x) == ThickenLinesArray[z])
-				existed_element = 1;
-				break;
-				}
-			if (existed_element == 1)
-				{
-				continue;
-				}
-			
-
-			ThickenLinesArray[counter] = ((y-1)*w)+(x-1);
-			counter++;
-			ThickenLinesArray[counter] = ((y-1)*w)+(x);
-			counter++;
-			ThickenLinesArray[counter] = ((y-1)*w)+(x+1);
-			counter++;
-
-			ThickenLinesArray[counter] = (y*w)+(x-1);
-			counter++;
-			ThickenLinesArray[counter] = (y*w)+x;
-			counter++;
-			ThickenLinesArray[counter] = (y*w)+(x+1);
-			counter++;
-
-			ThickenLinesArray[counter] = ((y+1)*w)+(x-1);
-			counter++;
-			ThickenLinesArray[counter] = ((y+1)*w)+(x);
-			counter++;
-			ThickenLinesArray[counter] = ((y+1)*w)+(x+1);
-			counter++;
-			
-			}
-		}
+		batch.images[i].batch = &batch;
+		batch.images[i].index = i;
+		batch.images[i].file = files[i];
+		SDL_AtomicSet(&batch.images[i].waiting, (options->palette_reuse >= 0 && i > 0) ? 2 : 1);
 	}
 	
-	for (int x=0; x<counter; x++)
+	for (int i=0; i<count; i++)
 	{
-		Uint32 pixel = SDL_MapRGB(BluredSurface->format,0,0,0);
-		int number = ThickenLinesArray[x];
-		pixels[number] = pixel;
+		WaitForCount(pool, &batch.in_flight, depth-1);
+		SDL_AtomicAdd(&batch.in_flight, 1);
+		SubmitTask(pool, DecodeImageTask, &batch.images[i], &batch.tasks);
 	}
+	WaitForTasks(pool, &batch.tasks);
+	
+	double Batch_time = (double)(SDL_GetPerformanceCounter()-Batch_start)/SDL_GetPerformanceFrequency();
+	printf("%d of %d images saved in %.3f s, %.2f images per second\n", SDL_AtomicGet(&batch.saved), count, Batch_time,
+		(Batch_time > 0) ? SDL_AtomicGet(&batch.saved)/Batch_time : 0);
 	
-	printf("Image is still working. Message 4/5\n");
-	free(ThickenLinesArray);
+	IMG_Quit();
+	free(batch.images);
+	return SDL_AtomicGet(&batch.failed);
 }
 
-void CombineReplace(int h, int w, SDL_Surface *BluredSurface, Uint32 *pixels, SDL_Surface *QuantizedSurface, Uint32 *Quantized_Pixels)
+int main (int argc, char*argv[])	//Command Line arguments
 {
-	/*Parameters are...
-	int h:	The height of the image.
-	int w:	The width of the image.
-	SDL_Surface *BluredSurface:	The surface which contains the edge detection.
-	Uint32 *pixels:	The pixels which contains the edge detection. 
-	SDL_Surface *QuantizedSurface:	The surface which contains the colour quantized and benday implemented image.
-	Uint32 *Quantized_Pixels:	The pixels which are colour quantized and/or have the benday implemented. */
-	
-	//Method 1
-	//Combining Edge detection and colour quantized image (Replacing)
-	for (int y=0; y<h; y++)
+BenDayOptions options;	//The options given at the start of the command line
+int First_image = ParseOptions(argc, argv, &options);	//This is the index of the first image, which comes right after the options
+int ProgramReload = argc - First_image;	//This variable is to check if there are more then one image loaded by the user. If yes, enables option to display next image
+int Current_image = First_image;	//This is the current image that is being displayed
+PaletteCache QuantizedPalette = {0};	//The colour palette of the previous image, kept for --palette-reuse
+
+//Check for command line
+//If an option is wrong or there are no arguments for pictures after the options, print error
+if (First_image<0 || (argc-First_image)<1)
 	{
-		for(int x=0; x<w; x++)
-		{
-		Uint8 r1,g1,b1;
-		SDL_GetRGB(pixels[(y)*w + (x)], BluredSurface->format, &r1,&g1,&b1);
-		if (r1>0 || g1>0 || b1>0)
-			{
-			continue;
-			}
-		else
-			{
-			Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,r1,g1,b1);
-			Quantized_Pixels[y*w+x] = pixel;
-			}
-		
-		}
+	printf("ERROR\n");
+	PrintUsage(argv[0]);
+	return (1);
 	}
-	printf("Image is still working. Message 5/5\n");
-}
 
-void CombineMultiply(int h, int w, SDL_Surface *BluredSurface, Uint32 *pixels, SDL_Surface *QuantizedSurface, Uint32 *Quantized_Pixels)
+//Decode the template given with --template once for every image. Its scaled versions are kept in the cache too.
+TemplateCache *Templates = NULL;
+if (options.template_file != NULL)
 {
-	/*Parameters are...
-	int h:	The height of the image.
-	int w:	The width of the image.
-	SDL_Surface *BluredSurface:	The surface which contains the edge detection.
-	Uint32 *pixels:	The pixels which contains the edge detection. 
-	SDL_Surface *QuantizedSurface:	The surface which contains the colour quantized and benday implemented image.
-	Uint32 *Quantized_Pixels:	The pixels which are colour quantized and/or have the benday implemented. */
+	Templates = CreateTemplateCache(options.template_file, (Sint64)options.template_cache << 20);
 	
-	//Method2
-	//Combining Edge detection and colour quantized image (Multiply)
-	for (int y=0; y<h; y++)
+	//If the template is not an image file, or the file directory is wrong, print an error
+	if (!Templates)
 	{
-		for(int x=0; x<w; x++)
-		{
-		Uint8 r1,g1,b1,r2,g2,b2;
-		float r3,g3,b3;
-		SDL_GetRGB(pixels[(y)*w + (x)], BluredSurface->format, &r1,&g1,&b1);
-		SDL_GetRGB(Quantized_Pixels[(y)*w + (x)], QuantizedSurface->format, &r2,&g2,&b2);
-		
-		r3 = (float)r1/255;
-		g3 = (float)g1/255;
-		b3 = (float)b1/255;
-		
-		r3 = (float)r2*r3;
-		g3 = (float)g2*g3;
-		b3 = (float)b2*b3;
-
-		//Make sure division is equal to float value.
-		//Multiply resulting value with r2,g2,b2
-		
-		Uint32 pixel = SDL_MapRGB(QuantizedSurface->format,(Uint8)r3,(Uint8)g3,(Uint8)b3);
-		Quantized_Pixels[y*w+x] = pixel;
-		}
+		fprintf(stderr, "Couldn't load %s: %s\n", options.template_file, SDL_GetError());
+		return 1;
 	}
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////
-//Initialising SDL Window, Renderer, Texture, Surfaces
-/////////////////////////////////////////////////////////////////////////////////////////////////
+//The threads are only started once the command line and the template are known to be good, so the returns above have nothing to stop
+ThreadPool *pool = CreateThreadPool(options.threads > 0 ? options.threads : SDL_GetCPUCount());	//The worker threads are kept for every image
+SelectPixelKernels(options.simd);	//Pick the widest per pixel kernels the CPU can run
 
-int main (int argc, char*argv[])	//Command Line arguments
+//With --output the images are saved straight away as a batch, with no window or waiting for keys.
+//Headless mode does not need video, so SDL is not initialised at all. Loading, converting and saving surfaces work without it.
+if (options.output != NULL)
 {
-int ProgramReload = argc - 2;	//This variable is to check if there are more then one image loaded by the user. If yes, enables option to display next image
-int Current_image = 2;	//This is the current image that is being displayed
+	int Failed = RunBatch(argv+First_image, argc-First_image, &options, pool, &QuantizedPalette, Templates);
+	DestroyTemplateCache(Templates);
+	DestroyThreadPool(pool);
+	return Failed;
+}
+
 do
 {
 	SDL_Window *window = NULL;	//Create the pointer WINDOW and make sure it has enough memory space
 	SDL_Renderer *renderer = NULL;	//Create the pointer RENDERER and make sure it has enough memory space
-	SDL_Surface *BluredSurface = NULL;	//Create the pointer BLUREDSURFACE and make sure it has enough memory space
-	SDL_Surface *GreaterBluredSurface = NULL;	//Create the pointer GREATERBLUREDSURFACE and make sure it has enough memory space
-	SDL_Surface *QuantizedSurface = NULL;	//Create the pointer QUANTIZEDSURFACE and make sure it has enough memory space
-	SDL_Surface *BenDaySurface = NULL;	//Create the pointer BENDAYSURFACE and make sure it has enough memory space
-	SDL_Surface *BenDayImage = NULL;	//Create the pointer BENDAYIMAGE and make sure it has enough memory space
-	SDL_Surface *OriginalSurface = NULL;	//Create the pointer ORIGINALSURFACE and make sure it has enough memory space
 	SDL_Surface *DisplayedImage = NULL;	//Create the pointer DISPLAYEDIMAGE and make sure it has enough memory space
 	SDL_Texture *texture = NULL;	//Create the pointer TEXTURE and make sure it has enough memory space
+	WorkingImage image;	//The surfaces and planes of the image, from the decoded image to the Ben Day image
 	
 	int w, h;	//Creates integer variables, width and height which will be used to set the size of the window
 	
-	//Check for command line
-	//If there is less than 3 command line arguments, which means no arguments for pictures and/or ben day template, print error
-	if (argc<3)
-		{
-		printf("ERROR\n");
-		fprintf(stderr, "Usage should be: %s <ben_day_dot template> <image_file> ...\n\n", argv[0]);
-		return (1);
-		}
-
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0)	//Initialise everything in SDL. If it is less than 0, there is an error
 	{
 		printf("Error in initialisation: %s\n",SDL_GetError());	//Prints out the error
@@ -907,36 +5247,21 @@ do
 	
 	/////////////////////////////////////////////////////////////////////////////////////////////////
 	
-	//Assign the Surfaces with the image
-	BluredSurface = IMG_Load(argv[Current_image]);
-	GreaterBluredSurface = IMG_Load(argv[Current_image]);
-	QuantizedSurface = IMG_Load(argv[Current_image]);
-	BenDaySurface = IMG_Load(argv[Current_image]);	//Just to get the size to be the same format
-	DisplayedImage = IMG_Load(argv[Current_image]);
-	OriginalSurface = IMG_Load(argv[Current_image]);
-	
-	/*If the BluredSurface is not an image file, or the file directory is wrong, print an error. Since all the surface are the same image,
-	checking one of them is enough.*/
-	if (!BluredSurface) 
+	//Decode the image once. The other surfaces are made from it.
+	//If the image is not an image file, or the file directory is wrong, print an error.
+	if (!LoadWorkingImage(&image, argv[Current_image])) 
 	{
             fprintf(stderr, "Couldn't load %s: %s\n", argv[Current_image], SDL_GetError());
             return 1;
     }
-        
-    //Assign the BenDayImage with the image to be loaded as seen in argv[1]
-    BenDayImage = IMG_Load(argv[1]);
-        
-    //If the BenDayImage is not an image file, or the file directory is wrong, print an error
-	if (!BenDayImage) 
-	{
-            fprintf(stderr, "Couldn't load %s: %s\n", argv[1], SDL_GetError());
-            return 1;
-    }
+    
+    w = image.w;
+    h = image.h;
         
     /////////////////////////////////////////////////////////////////////////////////////////////////
     
     //Create a texture
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, BluredSurface -> w, BluredSurface ->h);
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, w, h);
 	//If the texture cannot be created, print error
 	if (!texture) 
 	{
@@ -946,34 +5271,16 @@ do
 	/////////////////////////////////////////////////////////////////////////////////////////////////
 	
 	//Set window size according to size of image
-	SDL_QueryTexture(texture, NULL, NULL, &w, &h);
 	SDL_SetWindowSize(window, w, h);
 	
-	//Blitscaling BenDayImage to the size of the image file
-    SDL_Rect rect;
-    rect.x = 0;
-    rect.y =0;
-    rect.w = w;
-    rect.h = h;
-
-    SDL_BlitScaled(BenDayImage, NULL, BenDaySurface, &rect);
-    
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Convert existing surface to a new surface format.
-	BluredSurface = SDL_ConvertSurfaceFormat(BluredSurface, SDL_PIXELFORMAT_ARGB8888,0);
-	GreaterBluredSurface = SDL_ConvertSurfaceFormat(GreaterBluredSurface, SDL_PIXELFORMAT_ARGB8888,0);
-	QuantizedSurface = SDL_ConvertSurfaceFormat(QuantizedSurface, SDL_PIXELFORMAT_ARGB8888,0);
-	BenDaySurface = SDL_ConvertSurfaceFormat(BenDaySurface, SDL_PIXELFORMAT_ARGB8888,0);
-	OriginalSurface = SDL_ConvertSurfaceFormat(OriginalSurface, SDL_PIXELFORMAT_ARGB8888,0);
-	DisplayedImage = SDL_ConvertSurfaceFormat(DisplayedImage, SDL_PIXELFORMAT_ARGB8888,0);
+	//The displayed image starts out as the original
+	DisplayedImage = SDL_ConvertSurfaceFormat(image.OriginalSurface, SDL_PIXELFORMAT_ARGB8888,0);
 	
-	//Change the surface pixels from (void*)pixels to (Uint32*)pixels
-	Uint32 * pixels = (Uint32 *) BluredSurface -> pixels;
-	Uint32 * GBS_Pixels = (Uint32 *) GreaterBluredSurface -> pixels;
-	Uint32 * Quantized_Pixels = (Uint32 *) QuantizedSurface -> pixels;
-	Uint32 * BenDay_Pixels = (Uint32 *) BenDaySurface -> pixels;
-	Uint32 * Original_Pixels = (Uint32 *) OriginalSurface-> pixels;
-	Uint32 * Displayed_Pixels = (Uint32 *) DisplayedImage -> pixels;
+	if(DisplayedImage == NULL)
+	{
+		printf("Insufficient memory\n");
+		exit(1);
+	}
 	
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -984,76 +5291,17 @@ do
 	int isRunning = 1;	//Creates a boolean for the window loop
 	SDL_Event ev;	// Creates the SDL Event
 	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Reducing colour palette of the image (Median Cut Colour Quantization)
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	ColourQuantization(QuantizedSurface, w, h, Quantized_Pixels,16);	//Last argument is the colour_palette no. It should be a power of 2.
-	printf("\n\n");
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Creating Edge Detection (Convolution Blurring)
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	
-	//Set colours of BluredSurface and GreaterBluredSurface to that of a colour palette of 2
-	ColourQuantization(BluredSurface, w, h, pixels,2);	//Last argument is the colour_palette no. It should be a power of 2.
-	
-	for (int y = 0; y< h ;y++)	//Change the GreaterBluredSurface pixels to be the same as the BluredSurface pixels
-	{
-		for(int x = 0; x< w ; x++)
-		{	
-			GBS_Pixels[y*w + x] = pixels[y*w + x];
-		}			
-	}
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Grayscale code starts here
-	//Changes BluredSurface and GreaterBluredSurface to grey.
-	for (int y = 0; y< h ;y++)
-	{
-		for(int x = 0; x< w ; x++)
-		{	
-			//Grayscale function comes here
-			Uint32 pixel = pixels[y*w + x];
-			pixels[y*w + x] = CovertGrayscale(pixel);
-			GBS_Pixels[y*w + x] = pixels[y*w + x];
-		}			
-	}
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//EdgeDetection
-	EdgeDetection(h, w, BluredSurface, pixels, GreaterBluredSurface, GBS_Pixels);
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Replacing GBS_Pixels with Quantized_Pixels to store the results before we BenDay the image for easier viewing
-	for (int y = 0; y< h ;y++)
-	{
-		for(int x = 0; x< w ; x++)
-		{	
-			GBS_Pixels[y*w + x] = Quantized_Pixels[y*w + x];
-		}			
-	}
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Convert some colours to red/blue/yellow/black/white when appropriate and others to ben day dots template
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	
-	BenDay(h, w, QuantizedSurface, Quantized_Pixels, BenDaySurface, BenDay_Pixels);
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	//Combining edges from edge detection to the image.
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	
-	ThickenEdges(h, w, BluredSurface, pixels);
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
-	
-	//Combining Edge detection and colour quantized image
-	//Method 1
-	CombineReplace(h, w, BluredSurface, pixels, QuantizedSurface, Quantized_Pixels);
+	//Colour quantization, edge detection and BenDay
+	ProcessWorkingImage(&image, &options, pool, &QuantizedPalette, Templates);
 	
-	//Method2
-	//CombineMultiply(h, w, BluredSurface, pixels, QuantizedSurface, Quantized_Pixels);
-	
-	/////////////////////////////////////////////////////////////////////////////////////////////////
+	//Change the surface pixels from (void*)pixels to (Uint32*)pixels
+	Uint32 * pixels = (Uint32 *) image.BluredSurface -> pixels;
+	Uint32 * Quantized_Pixels = (Uint32 *) image.QuantizedSurface -> pixels;
+	Uint32 * Original_Pixels = (Uint32 *) image.OriginalSurface -> pixels;
+	Uint32 * Displayed_Pixels = (Uint32 *) DisplayedImage -> pixels;
+	Uint8 * Palette_Index = image.Palette_Index;
+	Uint32 * Palette_Colours = image.Palette_Colours;
+	Uint64 * Edge_Bits = image.Edge_Bits;
 	
 	/////////////////////////////////////////////////////////////////////////////////////////////////
 	
@@ -1088,7 +5336,7 @@ do
 							{
 								for(int x = 0; x< w ; x++)
 								{	
-									Displayed_Pixels[y*w + x] = Original_Pixels[y*w + x];
+									Displayed_Pixels[(Sint64)y*w + x] = Original_Pixels[(Sint64)y*w + x];
 								}			
 							}
 							break;
@@ -1098,28 +5346,29 @@ do
 							{
 								for(int x = 0; x< w ; x++)
 								{	
-									Displayed_Pixels[y*w + x] = Quantized_Pixels[y*w + x];
+									Displayed_Pixels[(Sint64)y*w + x] = Quantized_Pixels[(Sint64)y*w + x];
 								}			
 							}
 							break;	
 							
-						case SDLK_e:    //When user presses e, it displays the Quantized Surface without BenDay or edge
+						case SDLK_e:    //When user presses e, it displays the Quantized Surface without BenDay or edge, made from the palette index
 							for (int y = 0; y< h ;y++)
 							{
 								for(int x = 0; x< w ; x++)
 								{	
-									Displayed_Pixels[y*w + x] = GBS_Pixels[y*w + x];
+									Displayed_Pixels[(Sint64)y*w + x] = Palette_Colours[Palette_Index[(Sint64)y*w + x]];
 								}			
 							}
 							break;
 							
-						case SDLK_r:    //When user presses e, it displays the Edge Detection
+						case SDLK_r:    //When user presses r, it displays the Edge Detection, or the soft edges with --blend=multiply, with the thickened edges
 							for (int y = 0; y< h ;y++)
 							{
 								for(int x = 0; x< w ; x++)
 								{	
-									Displayed_Pixels[y*w + x] = pixels[y*w + x];
-								}			
+									Displayed_Pixels[(Sint64)y*w + x] = pixels[(Sint64)y*w + x];
+								}
+								CombineReplace(Edge_Bits+(Sint64)y*((w+63)/64), Displayed_Pixels+(Sint64)y*w, (w+63)/64);
 							}
 							break;
 						
@@ -1201,26 +5450,19 @@ do
 	SDL_DestroyWindow(window);	//Destroy and free the memory space used to create the Window
 	SDL_DestroyTexture(texture);
 	SDL_DestroyRenderer(renderer);
-	SDL_FreeSurface(BluredSurface);
-	SDL_FreeSurface(GreaterBluredSurface);
-	SDL_FreeSurface(QuantizedSurface);
-	SDL_FreeSurface(BenDaySurface);
-	SDL_FreeSurface(BenDayImage);
-	SDL_FreeSurface(OriginalSurface);
+	FreeWorkingImage(&image);
 	SDL_FreeSurface(DisplayedImage);
 	
 	window = NULL;
 	renderer = NULL;
-	BluredSurface = NULL;
-	GreaterBluredSurface = NULL;
-	QuantizedSurface = NULL;
-	BenDaySurface = NULL;
-	BenDayImage = NULL;
+	DisplayedImage = NULL;
 	texture = NULL;
 	
 	SDL_Quit();
 	ProgramReload --;
 	Current_image ++;
 }while(ProgramReload>0);
+	DestroyTemplateCache(Templates);
+	DestroyThreadPool(pool);
 	return 0;
 }